@@ -1,10 +1,33 @@
+#ifndef _WIN32
+    #define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 #ifndef _WIN32
 	#include <stdbool.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/select.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <EGL/egl.h>
+    #include <EGL/eglext.h>
+    #include <pthread.h>
+    typedef int SOCKET;
+    #define INVALID_SOCKET -1
+    #define closesocket close
 #else
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
     #include <windows.h>
+    #pragma comment(lib, "ws2_32.lib")
 	#define bool int
 	#define true 1
 	#define false 0
@@ -12,7 +35,9 @@
 
 #include <math.h>
 #include <time.h>
+#include <signal.h>
 
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
 
 
@@ -21,6 +46,14 @@
 
 #define FXAA_SAMPLES 16
 
+#define TARGET_FPS 60
+#define QUALITY_WINDOW 30           // frames averaged before the governor decides anything
+#define QUALITY_DOWN 1.15           // step down above this fraction of the frame budget
+#define QUALITY_UP 0.6              // step up below this one
+                                    // these assume an uncapped loop, so render_setup turns vsync off
+#define QUALITY_BACKOFF 4           // windows before retrying a level that was just too slow
+#define QUALITY_BACKOFF_MAX 128     // the wait doubles each time that level fails again, up to this
+
 #define PI 3.14159265358979323846
 #define DEG2RAD(x) ((x/180.0f)*PI)
 #define RAD2DEG(x) ((x*180.0f)/PI)
@@ -31,6 +64,7 @@
 #define min(x,y) (x<y?x:y)
 
 #define TIMEDEL60 (1/(double)60)
+#define IDLE_WAIT 0.1               // seconds between wakeups while paused
 #define FOV DEG2RAD(60.0f)
 
 #define MOVEMENT_SPEED 4.0f     // units/sec
@@ -45,6 +79,84 @@
 #define PROJECTILE_SPEED 8.0f
 #define ENEMY_SPEED 1.0f
 
+#define GAME_RAND_MAX 32767
+
+#define SNAPSHOT_MAGIC 0x4F474F59   // "YOGO"
+#define SNAPSHOT_VERSION 1
+#define SAVE_FILE "yogo.sav"
+
+#define LEVEL_CACHE_MAGIC 0x4C474F59    // "YOGL"
+#define LEVEL_CACHE_VERSION 1
+#define LEVEL_CACHE_FILE "yogo.levels"
+
+#define MAX_PLAYERS 8
+#define NET_MAX_ENTITIES (MAX_ENEMIES+MAX_PROJECTILES)
+#define NET_MAX_PACKET 60000
+#define NET_HISTORY 16              // snapshots each side keeps around as delta bases
+#define NET_SNAPSHOT_INTERVAL 2     // ticks between snapshots, 30 per second
+#define NET_INPUT_INTERVAL (1/(double)30)
+#define NET_TIMEOUT 5.0
+#define NET_VIEW_RANGE 32.0f        // the range enemies despawn at, nothing further away matters to a player
+#define NET_POS_SCALE 64.0f         // positions go over the wire in 1/64ths of a unit
+
+#define NET_HELLO 1
+#define NET_WELCOME 2
+#define NET_INPUT 3
+#define NET_SNAPSHOT 4
+
+#define NET_OP_REMOVE 1
+#define NET_OP_ADD 2
+#define NET_OP_MOVE8 4
+#define NET_OP_MOVE16 8
+#define NET_OP_EXTRA 16
+
+#define INPUT_UP 1
+#define INPUT_DOWN 2
+#define INPUT_LEFT 4
+#define INPUT_RIGHT 8
+#define INPUT_FORWARD 16
+#define INPUT_SHOOT 32
+#define INPUT_SHOOT_KEY 64
+
+#define GOLDEN_TOLERANCE 8          // per channel, antialiasing differs slightly between drivers
+#define GOLDEN_MAX_MISMATCH 0.001   // fraction of pixels allowed over the tolerance
+
+#define EVENT_LOG_MAGIC 0x45474F59      // "YOGE"
+#define EVENT_LOG_VERSION 1
+#define EVENT_LOG_FILE "yogo.events"
+#define EVENT_RING_SIZE 8192        // must be a power of two
+#define EVENT_WRITER_SLEEP 5        // ms the writer naps when the ring is empty
+
+#define EVENT_KILL 1
+#define EVENT_DEATH 2
+#define EVENT_OBJECTIVE 3
+#define EVENT_LEVEL 4
+#define EVENT_SCORE 5
+#define EVENT_DROPPED 6
+#define NUM_EVENT_TYPES 7
+
+#define CAUSE_NONE 0
+#define CAUSE_EDGE 1
+#define CAUSE_TIME 2
+#define CAUSE_BULLET 3
+#define CAUSE_ENEMY 4
+#define CAUSE_OBJECTIVE 5
+#define CAUSE_RESTART 6
+#define NUM_CAUSES 7
+
+#define REWIND_SLOTS 128
+#define REWIND_INTERVAL 30          // ticks between rewind snapshots, 128*30 ticks covers a whole level
+
+#if defined(__GNUC__)                               // gcc and clang, MinGW included
+    #define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+    #define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)                             // Interlocked calls are full barriers on every MSVC target
+    #define LOAD_ACQUIRE(p) ((unsigned int)InterlockedOr((volatile LONG *)(p), 0))
+    #define STORE_RELEASE(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#else
+    #error "No acquire/release atomics for this compiler"
+#endif
+
 #ifndef _WIN32
     #define sleepytime(x) for(int i=0;i<x;i++){}    // usleep and microsleep are too finicky...
 #else                                               // I apologize if you have a terrible computer
@@ -62,6 +174,7 @@ typedef struct {
     float angle;
     bool alive;
     float alive_time;
+    int owner;
 } Projectile;
 
 typedef struct {
@@ -75,6 +188,124 @@ typedef struct {
     float score;
 } Objective;
 
+typedef struct {
+    uint16_t id;                    // enemies use their index, projectiles MAX_ENEMIES + theirs
+    int16_t x, y;
+    uint8_t extra;                  // enemy direction or projectile age
+} NetEntity;
+
+typedef struct {                    // what one client has been sent, sorted by id
+    uint16_t seq;
+    bool valid;
+    int count;
+    NetEntity entities[NET_MAX_ENTITIES];
+} NetView;
+
+typedef struct {
+    struct sockaddr_in addr;
+    bool active;
+    float x, z;
+    float rot;
+    int buttons;
+    int score;
+    double last_heard;
+    uint16_t input_seq;
+    uint16_t seq;
+    uint16_t acked;
+    bool has_ack;
+    size_t bytes_sent;
+    int snapshots_sent;
+    int sends_failed;
+    NetView history[NET_HISTORY];
+} Player;
+
+typedef struct {
+    SOCKET sock;
+    struct sockaddr_in server;
+    int id;
+    uint16_t input_seq;
+    uint16_t latest;
+    bool has_latest;
+    size_t bytes_received;
+    NetView history[NET_HISTORY];
+} NetClient;
+
+typedef struct {                    // one fixed-size record in the event log
+    int32_t tick;
+    uint8_t type;
+    uint8_t player;
+    uint16_t cause;
+    float x, y;
+    int32_t value;                  // points, or the new level's seed
+    int32_t total;                  // the player's score afterwards
+} Event;
+
+typedef struct {                    // single producer (the simulation), single consumer (the writer thread)
+    unsigned int head;
+    char pad0[60];
+    unsigned int tail;
+    char pad1[60];
+    Event events[EVENT_RING_SIZE];
+} EventRing;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+} EventLogHeader;
+
+typedef struct {
+    int samples;
+    float scale;
+    bool outlines;
+    int grid_step;
+} QualityLevel;
+
+typedef struct {                    // fixed part of a save-state, followed by the grid bitmap,
+    double timer;                   // buildings, live enemies and live projectiles
+    double cursor_x, cursor_y;
+    uint32_t magic;
+    uint16_t version;
+    uint16_t numBuildings;
+    uint16_t numEnemies;
+    uint16_t numLiveProjectiles;
+    uint16_t numProjectiles;
+    uint16_t currentProjectile;
+    int32_t building_seed, next_seed;
+    uint32_t rand_state;
+    int32_t ticks;
+    int32_t score;
+    float pos_x, pos_y, pos_z, rot_y;
+    float movement_speed, enemy_speed, initial_enemy_speed;
+    Objective objective;
+} SnapshotHeader;
+
+typedef struct {
+    unsigned char *data;
+    size_t size, capacity;
+} Snapshot;
+
+typedef struct {                    // level cache file: header, index sorted by seed, then records
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t record_size;
+} LevelCacheHeader;
+
+typedef struct {
+    int32_t seed;
+    uint32_t record;
+} LevelCacheIndex;
+
+typedef struct {                    // laid out exactly like the globals so a hit is just two memcpys
+    int32_t seed, next_seed;
+    uint32_t rand_state;
+    int32_t numBuildings;
+    float objective_x, objective_y;
+    Building buildings[NUM_BUILDINGS];
+    bool grid[200][200];
+} LevelRecord;
+
 
 GLFWwindow *window;
 
@@ -89,6 +320,8 @@ double cursor_x, cursor_y;
 double cursor_dx, cursor_dy;
 
 bool capture_cursor = true;
+bool window_focused = true;
+bool window_iconified = false;
 
 float movement_speed = MOVEMENT_SPEED;
 float turn_speed = TURN_SPEED;
@@ -115,35 +348,266 @@ int next_seed;
 int ticks = 0;
 double timer = 0.0f;
 
+unsigned int rand_state = 1;
+
+Snapshot rewind_ring[REWIND_SLOTS];
+int rewind_head = 0;
+int rewind_count = 0;
+
+bool key_state[GLFW_KEY_LAST+1];
+
+QualityLevel quality_levels[] = {
+    { 0,            0.5f,  false, 4 },
+    { 0,            0.75f, false, 2 },
+    { 0,            1.0f,  true,  2 },
+    { 2,            1.0f,  true,  1 },
+    { 4,            1.0f,  true,  1 },
+    { 8,            1.0f,  true,  1 },
+    { FXAA_SAMPLES, 1.0f,  true,  1 },
+};
+#define NUM_QUALITY_LEVELS (int)(sizeof(quality_levels)/sizeof(quality_levels[0]))
+
+int quality_level = NUM_QUALITY_LEVELS-1;
+double frame_times[QUALITY_WINDOW];
+int numFrameTimes = 0;
+int quality_blocked = -1;           // level the governor may not step up to until the backoff runs out
+int quality_backoff = 0;
+int quality_penalty = QUALITY_BACKOFF;
+
+bool fbo_tried = false;             // framebuffers are only set up once, and never again after they fail
+bool fbo_supported = false;
+bool fbo_bound = false;
+GLint max_samples = 0;
+GLuint msaa_fbo, msaa_color, msaa_depth;
+GLuint resolve_fbo, resolve_color, resolve_depth;
+int fbo_width = 0, fbo_height = 0, fbo_samples = -1;
+
+PFNGLGENFRAMEBUFFERSPROC pglGenFramebuffers;
+PFNGLDELETEFRAMEBUFFERSPROC pglDeleteFramebuffers;
+PFNGLBINDFRAMEBUFFERPROC pglBindFramebuffer;
+PFNGLGENRENDERBUFFERSPROC pglGenRenderbuffers;
+PFNGLDELETERENDERBUFFERSPROC pglDeleteRenderbuffers;
+PFNGLBINDRENDERBUFFERPROC pglBindRenderbuffer;
+PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC pglRenderbufferStorageMultisample;
+PFNGLFRAMEBUFFERRENDERBUFFERPROC pglFramebufferRenderbuffer;
+PFNGLCHECKFRAMEBUFFERSTATUSPROC pglCheckFramebufferStatus;
+PFNGLBLITFRAMEBUFFERPROC pglBlitFramebuffer;
+
+EventRing event_ring;
+FILE *event_log = NULL;
+unsigned int event_log_stop = 0;
+unsigned int events_dropped = 0;
+#ifndef _WIN32
+pthread_t event_thread;
+#else
+HANDLE event_thread;
+#endif
+
+bool offscreen = false;
+#ifndef _WIN32
+EGLDisplay egl_display = EGL_NO_DISPLAY;
+EGLContext egl_context = EGL_NO_CONTEXT;
+#endif
+
+bool server_mode = false;
+volatile sig_atomic_t server_stop = 0;
+int local_player = -1;
+Player players[MAX_PLAYERS];
+NetClient net_client;
+NetView net_view;
+unsigned char net_buf[NET_MAX_PACKET];
+
+void *level_cache = NULL;
+size_t level_cache_size = 0;
+const LevelCacheIndex *level_index = NULL;
+const LevelRecord *level_records = NULL;
+int numCachedLevels = 0;
 
+
+void openWindow();
 void setup();
 void render_setup();
 
+void generateLevel();
+bool openLevelCache(const char *path);
+void closeLevelCache();
+bool loadCachedLevel(int seed);
+bool buildLevelCache(const char *path, int seed, int count);
 void makeBuildings(int buildingCount);
-void makeEnemies();
-void addProjectile(float x, float y);
+void makeEnemies(float around_x, float around_y);
+void addProjectile(float x, float y, float angle, int owner);
 
 void step();
+void simulate();
 void moveEnemies();
 void moveProjectiles();
 
+int playerCount();
+bool playerPos(int p, float *x, float *z);
+bool nearPlayer(float x, float y, float range);
+void playerDied(int p, int cause, char *message);
+void playerScored(int p, float points);
+
+bool isIdle();
+void idle();
+void idleInput();
+
 void get_input();
+void get_common_input();
+int readButtons();
+void movePlayer(float *x, float *z, float rot, int buttons);
+void firePlayer(float x, float z, float rot, int buttons, int owner);
+bool keyPressed(int key);
 
 void render();
 void drawBuildings();
+void drawPlayers();
+
+GLFWglproc getProcAddress(const char *name);
+bool extensionSupported(const char *name);
+bool loadFramebufferFunctions();
+void resizeFramebuffers(int w, int h, int samples);
+void deleteFramebuffers();
+void beginFrame();
+void endFrame();
+int effectiveSamples(int level);
+bool sameQuality(int a, int b);
+int nextQuality(int level, int dir);
+void resetQualityBackoff();
+void updateQuality(double frame_time);
+
+void DIE(int cause, char *message);
+
+int gameRand();
+void gameSrand(unsigned int seed);
+
+size_t saveState(unsigned char *buf, size_t capacity);
+bool inLevel(float v);
+bool loadState(const unsigned char *buf, size_t size);
+size_t maxStateSize();
+bool captureState(Snapshot *snap);
+void resumeState();
+bool saveStateFile(const char *path);
+bool loadStateFile(const char *path);
+void pushRewind();
+bool popRewind();
+void benchSnapshots(int iterations);
+
+double nowSeconds();
+bool netInit();
+SOCKET netOpen(uint32_t address, int port);
+void netWait(SOCKET sock, double seconds);
+void netPut16(unsigned char **p, int v);
+void netPut32(unsigned char **p, int32_t v);
+int netGet16(const unsigned char **p);
+int32_t netGet32(const unsigned char **p);
+int16_t netQuantize(float v);
+void buildView(NetView *v, float x, float z);
+size_t encodeSnapshot(unsigned char *buf, int p, const NetView *view);
+bool decodeSnapshot(NetClient *c, const unsigned char *buf, size_t len, bool apply);
+void applyView(const NetView *v);
+int addPlayer(const struct sockaddr_in *addr);
+void serverSetup();
+void serverReceive(SOCKET sock);
+void serverTick();
+void sendSnapshots(SOCKET sock);
+void stopServer(int sig);
+void runServer(int port);
+bool clientOpen(NetClient *c, const char *host, int port);
+void clientHello(NetClient *c);
+void clientSendInput(NetClient *c, int buttons, float rot);
+void clientReceive(NetClient *c, bool apply);
+void runClient(const char *host, int port);
+void benchNetwork(int numClients);
+
+bool openEventLog(const char *path);
+void closeEventLog();
+void logEvent(int type, int player, int cause, float x, float y, int value, int total);
+void eventWriterLoop();
+#ifndef _WIN32
+void *eventWriterThread(void *arg);
+#else
+DWORD WINAPI eventWriterThread(LPVOID arg);
+#endif
+int summarizeEvents(const char *path);
 
-void DIE(char *message);
+bool openOffscreenContext();
+void closeOffscreenContext();
+int scriptInput(int frame);
+bool writePPM(const char *path, int w, int h, const unsigned char *pixels);
+unsigned char *readPPM(const char *path, int *w, int *h);
+bool compareGolden(const char *path, int w, int h, const unsigned char *pixels);
+int compareDoubles(const void *a, const void *b);
+int runOffscreen(int frames, int every, const char *dump_dir, const char *golden_dir);
 
 double getFPS();
 void cleanup();
 
 void scroll_callback(GLFWwindow *window, double xoffset, double yoffset);
+void focus_callback(GLFWwindow *window, int focused);
+void iconify_callback(GLFWwindow *window, int iconified);
 void error_callback(int error, const char *description);
 void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 
 
 int main(int argc, char *argv[])
 {
+    if ( argc >= 2 && strcmp(argv[1], "--bench-snapshot") == 0 ) {
+        building_seed = argc >= 3 ? atoi(argv[2]) : 0;
+        benchSnapshots(10000);
+        exit(EXIT_SUCCESS);
+    }
+
+    if ( argc >= 3 && strcmp(argv[1], "--server") == 0 ) {
+        building_seed = argc >= 4 ? atoi(argv[3]) : 0;
+        runServer(atoi(argv[2]));
+        exit(EXIT_SUCCESS);
+    }
+    if ( argc >= 4 && strcmp(argv[1], "--connect") == 0 ) {
+        runClient(argv[2], atoi(argv[3]));
+        exit(EXIT_SUCCESS);
+    }
+    if ( argc >= 2 && strcmp(argv[1], "--bench-net") == 0 ) {
+        building_seed = 0;
+        benchNetwork(argc >= 3 ? atoi(argv[2]) : 4);
+        exit(EXIT_SUCCESS);
+    }
+
+    if ( argc >= 4 && strcmp(argv[1], "--render") == 0 ) {
+        const char *dump_dir = NULL, *golden_dir = NULL;
+        int every = 60;
+        int i;
+        
+        building_seed = atoi(argv[2]);
+        width = WINDOW_WIDTH;
+        height = WINDOW_HEIGHT;
+        
+        for ( i=4 ; i+1<argc ; i+=2 ) {
+            if ( strcmp(argv[i], "--size") == 0 )
+                sscanf(argv[i+1], "%ix%i", &width, &height);
+            else if ( strcmp(argv[i], "--every") == 0 )
+                every = max(atoi(argv[i+1]), 1);
+            else if ( strcmp(argv[i], "--quality") == 0 )
+                quality_level = min(max(atoi(argv[i+1]), 0), NUM_QUALITY_LEVELS-1);
+            else if ( strcmp(argv[i], "--dump") == 0 )
+                dump_dir = argv[i+1];
+            else if ( strcmp(argv[i], "--golden") == 0 )
+                golden_dir = argv[i+1];
+        }
+        
+        exit(runOffscreen(atoi(argv[3]), every, dump_dir, golden_dir));
+    }
+
+    if ( argc >= 2 && strcmp(argv[1], "--summarize-events") == 0 ) {
+        exit(summarizeEvents(argc >= 3 ? argv[2] : EVENT_LOG_FILE));
+    }
+
+    if ( argc >= 4 && strcmp(argv[1], "--build-levels") == 0 ) {
+        if ( !buildLevelCache(LEVEL_CACHE_FILE, atoi(argv[2]), atoi(argv[3])) )
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
+
     if ( argc >= 2 ) {
         building_seed = atoi(argv[1]);
     } else {
@@ -151,30 +615,22 @@ int main(int argc, char *argv[])
         building_seed = rand();
     }
         
-    glfwSetErrorCallback(error_callback);
-
-    if ( !glfwInit() )
-        exit(EXIT_FAILURE);
-
-    glfwWindowHint(GLFW_SAMPLES, FXAA_SAMPLES);
-
-    window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "LD28 - You only get one", NULL, NULL);
-    if ( !window )
-    {
-        glfwTerminate();
-        exit(EXIT_FAILURE);
-    }
-
-    glfwSetScrollCallback(window, scroll_callback);
+    openWindow();
     
     printf("You Only Get One - LD28\n\n");
     printf("The aim of this game is to fight your way through the red squares to the objective marker indicated by the green line. ");
     printf("You only get one minute.\n\n");
     printf("Controls (YOGO/classic):\n\tmouse: aim\n\tleft-click: shoot\n\tright-click: move forward\n\tscroll: zoom\n");
     printf("Controls (casual):\n\tWASD: movement\n\tmouse: aim\n\tspace: shoot\n\tscroll/shift/ctrl: zoom\n");
-    printf("R to generate a new level\nE to release/recapture mouse\nESC to exit\n\n");
+    printf("R to generate a new level\nE to release/recapture mouse\nF5/F9 to quicksave/quickload\nBackspace to rewind\nESC to exit\n\n");
     printf("Have fun! Made by Chris Harrison (and coffee), December 2013\n\n");
     
+    if ( openLevelCache(LEVEL_CACHE_FILE) )
+        printf("Using %i prebuilt levels from %s\n\n", numCachedLevels, LEVEL_CACHE_FILE);
+
+    if ( !openEventLog(EVENT_LOG_FILE) )
+        fprintf(stderr, "Could not open %s, playing without an event log\n", EVENT_LOG_FILE);
+
     pos_y = 8.0f;
     setup();
     render_setup();
@@ -182,6 +638,10 @@ int main(int argc, char *argv[])
 
     while ( !glfwWindowShouldClose(window) )
     {
+        if ( isIdle() ) {
+            idle();
+            continue;
+        }
         step();
         render();
     }
@@ -192,49 +652,289 @@ int main(int argc, char *argv[])
     exit(EXIT_SUCCESS);
 }
 
-void setup()
+void openWindow()
 {
-    int width, height;
-    glfwGetWindowSize(window, &width, &height);
-    glfwSetCursorPos(window, width/2, height/2);
+    glfwSetErrorCallback(error_callback);
 
-    tv0 = glfwGetTime();
+    if ( !glfwInit() )
+        exit(EXIT_FAILURE);
+
+    window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "LD28 - You only get one", NULL, NULL);
+    if ( !window )
+    {
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    glfwSetScrollCallback(window, scroll_callback);
+    glfwSetWindowFocusCallback(window, focus_callback);
+    glfwSetWindowIconifyCallback(window, iconify_callback);
+}
 
-    srand(building_seed);
-    next_seed = rand();
+void setup()
+{
+    if ( !offscreen ) {
+        int width, height;
+        glfwGetWindowSize(window, &width, &height);
+        glfwSetCursorPos(window, width/2, height/2);
 
-    numBuildings = NUM_BUILDINGS;
-    makeBuildings(numBuildings);
+        tv0 = glfwGetTime();
+    }
 
-    do {
-        objective.x = rand()%200-100;
-        objective.y = rand()%200-100;
-        objective.score = (abs(objective.x) + abs(objective.y)) * initial_enemy_speed;
-    } while ( (grid[(int)objective.x+100][(int)objective.y+100] || grid[(int)objective.x+100-1][(int)objective.y+100] ||
-              grid[(int)objective.x+100-1][(int)objective.y+100-1] || grid[(int)objective.x+100][(int)objective.y+100-1]) &&
-              (abs(objective.x) < 90 && abs(objective.y) < 90) );
+    generateLevel();
 
 	int i;
     for ( i=0 ; i<MAX_ENEMIES ; i++ ) {
         enemies[i].alive = false;
     }
     
-    glfwSetTime(0.0f);
+    if ( !offscreen )
+        glfwSetTime(0.0f);
     timer = 0;
     
     rot_y = 0.0f;
     pos_x = 0.0f;
     pos_z = 0.0f;
 
+    rewind_count = 0;
+    pushRewind();
+    
+    resetQualityBackoff();          // a new level has a different cost, so give every quality level another chance
+}
+
+void generateLevel()
+{
+    if ( !loadCachedLevel(building_seed) )
+    {
+        gameSrand(building_seed);
+        next_seed = gameRand();
+
+        makeBuildings(NUM_BUILDINGS);
+
+        do {
+            objective.x = gameRand()%200-100;
+            objective.y = gameRand()%200-100;
+        } while ( (grid[(int)objective.x+100][(int)objective.y+100] || grid[(int)objective.x+100-1][(int)objective.y+100] ||
+                  grid[(int)objective.x+100-1][(int)objective.y+100-1] || grid[(int)objective.x+100][(int)objective.y+100-1]) &&
+                  (abs(objective.x) < 90 && abs(objective.y) < 90) );
+    }
+
+    objective.score = (abs(objective.x) + abs(objective.y)) * initial_enemy_speed;
+}
+
+int compareLevelIndex(const void *a, const void *b)
+{
+    int32_t x = ((const LevelCacheIndex *)a)->seed;
+    int32_t y = ((const LevelCacheIndex *)b)->seed;
+    
+    return (x > y) - (x < y);
+}
+
+bool openLevelCache(const char *path)
+{
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if ( fd < 0 )
+        return false;
+    
+    struct stat st;
+    if ( fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LevelCacheHeader) ) {
+        close(fd);
+        return false;
+    }
+    
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( data == MAP_FAILED )
+        return false;
+    
+    level_cache = data;
+    level_cache_size = st.st_size;
+#else
+    FILE *f = fopen(path, "rb");
+    if ( !f )
+        return false;
+    
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+    level_cache = size > 0 ? malloc(size) : NULL;
+    if ( !level_cache || fread(level_cache, 1, size, f) != (size_t)size ) {
+        free(level_cache);
+        level_cache = NULL;
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+    level_cache_size = size;
+#endif
+    
+    const LevelCacheHeader *h = level_cache;
+    
+    if ( level_cache_size < sizeof(LevelCacheHeader) ||        // nothing in h is read before this
+         h->magic != LEVEL_CACHE_MAGIC || h->version != LEVEL_CACHE_VERSION ||
+         h->record_size != sizeof(LevelRecord) ||
+         (size_t)h->count > (level_cache_size - sizeof(LevelCacheHeader)) / (sizeof(LevelCacheIndex) + sizeof(LevelRecord)) )
+    {
+        fprintf(stderr, "Ignoring %s: not a level cache for this build\n", path);
+        closeLevelCache();
+        return false;
+    }
+    
+    size_t records = sizeof(LevelCacheHeader) + (size_t)h->count * sizeof(LevelCacheIndex);
+    level_index = (const LevelCacheIndex *)((const char *)level_cache + sizeof(LevelCacheHeader));
+    level_records = (const LevelRecord *)((const char *)level_cache + records);
+    numCachedLevels = h->count;
+    
+    return true;
+}
+
+void closeLevelCache()
+{
+    if ( !level_cache )
+        return;
+    
+#ifndef _WIN32
+    munmap(level_cache, level_cache_size);
+#else
+    free(level_cache);
+#endif
+    
+    level_cache = NULL;
+    level_cache_size = 0;
+    level_index = NULL;
+    level_records = NULL;
+    numCachedLevels = 0;
+}
+
+bool loadCachedLevel(int seed)
+{
+    if ( numCachedLevels == 0 )
+        return false;
+    
+    LevelCacheIndex key;
+    key.seed = seed;
+    
+    const LevelCacheIndex *hit = bsearch(&key, level_index, numCachedLevels, sizeof(LevelCacheIndex), compareLevelIndex);
+    if ( !hit || hit->record >= (uint32_t)numCachedLevels )
+        return false;
+    
+    const LevelRecord *r = &level_records[hit->record];
+    if ( r->numBuildings < 0 || r->numBuildings > NUM_BUILDINGS )
+        return false;
+    
+    next_seed = r->next_seed;
+    rand_state = r->rand_state;
+    numBuildings = r->numBuildings;
+    objective.x = r->objective_x;
+    objective.y = r->objective_y;
+    memcpy(buildings, r->buildings, numBuildings * sizeof(Building));
+    memcpy(grid, r->grid, sizeof(grid));
+    
+    return true;
+}
+
+bool buildLevelCache(const char *path, int seed, int count)     // follows the level chain from seed, the order levels are played in
+{
+    LevelCacheIndex *index = count > 0 ? malloc(count * sizeof(LevelCacheIndex)) : NULL;
+    LevelRecord *r = malloc(sizeof(LevelRecord));
+    unsigned char *visited = calloc((GAME_RAND_MAX+1)/8, 1);      // every seed after the first is a gameRand() value
+    if ( !index || !r || !visited ) {
+        free(index);
+        free(r);
+        free(visited);
+        return false;
+    }
+    
+    LevelCacheHeader h;
+    h.magic = LEVEL_CACHE_MAGIC;
+    h.version = LEVEL_CACHE_VERSION;
+    h.count = 0;
+    h.record_size = sizeof(LevelRecord);
+    
+    int i;
+    for ( i=0 ; i<count ; i++ )         // next_seed is the first draw after seeding, so the chain is cheap to walk
+    {
+        if ( seed >= 0 && seed <= GAME_RAND_MAX ) {     // a seed outside that range can only start the chain, never repeat
+            if ( visited[seed/8] & (1 << seed%8) )
+                break;
+            visited[seed/8] |= 1 << seed%8;
+        }
+        
+        index[i].seed = seed;
+        index[i].record = i;
+        h.count++;
+        
+        gameSrand(seed);
+        seed = gameRand();
+    }
+    
+    FILE *f = fopen(path, "wb");
+    bool ok = f != NULL;
+    
+    qsort(index, h.count, sizeof(LevelCacheIndex), compareLevelIndex);
+    for ( i=0 ; i<(int)h.count ; i++ )
+        index[i].record = i;
+    
+    ok = ok && fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && fwrite(index, sizeof(LevelCacheIndex), h.count, f) == h.count;
+    
+    clock_t c0 = clock();
+    
+    for ( i=0 ; i<(int)h.count && ok ; i++ )
+    {
+        building_seed = index[i].seed;
+        generateLevel();
+        
+        memset(r, 0, sizeof(LevelRecord));
+        r->seed = building_seed;
+        r->next_seed = next_seed;
+        r->rand_state = rand_state;
+        r->numBuildings = numBuildings;
+        r->objective_x = objective.x;
+        r->objective_y = objective.y;
+        memcpy(r->buildings, buildings, numBuildings * sizeof(Building));
+        memcpy(r->grid, grid, sizeof(grid));
+        
+        ok = fwrite(r, sizeof(LevelRecord), 1, f) == 1;
+    }
+    
+    clock_t c1 = clock();
+    
+    if ( f )
+        ok = (fclose(f) == 0) && ok;
+    
+    if ( ok )
+        printf("Wrote %u levels to %s (%.1f us/level to generate)\n",
+               (unsigned)h.count, path, (c1-c0) * 1e6 / CLOCKS_PER_SEC / h.count);
+    else
+        fprintf(stderr, "Could not write %s\n", path);
+    
+    free(index);
+    free(r);
+    free(visited);
+    return ok;
 }
 
 void render_setup()
 {
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
-    glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    if ( !offscreen ) {
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
+        glfwMakeContextCurrent(window);
+        glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+        glfwGetFramebufferSize(window, &width, &height);
+        glfwSwapInterval(0);        // the quality governor needs real frame times, not the wait for vblank
+    }
+
+    if ( !fbo_tried ) {
+        fbo_tried = true;
+        if ( (fbo_supported = loadFramebufferFunctions()) )
+            glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+    }
+    
+    resetQualityBackoff();
 
-    glfwGetFramebufferSize(window, &width, &height);
     ratio = width/(float)height;
 
     glViewport(0, 0, width, height);
@@ -263,78 +963,194 @@ void step()
     glfwPollEvents();
     get_input();
     
-    if ( pos_x > 100 || pos_x < -100 || pos_z > 100 || pos_z < -100 )
+    timer = glfwGetTime();
+    simulate();
+
+    if ( ticks%REWIND_INTERVAL == 0 )
+        pushRewind();
+
+    double fps = getFPS();
+    updateQuality(Tdel);
+
+    char title[256];
+    #ifdef _WIN32
+        sprintf_s(title, "LD28 - You only have one @ %.1f FPS, Q%i", (float)fps, quality_level);
+    #else
+        snprintf(title, 256, "LD28 - You only have one @ %.1f FPS, Q%i", (float)fps, quality_level);
+    #endif
+    glfwSetWindowTitle(window, title);
+}
+
+void simulate()     // one tick of game logic, for the local player or every connected one on a server
+{
+    int p;
+    float x, z;
+    
+    for ( p=0 ; p<playerCount() ; p++ )
     {
-        DIE("You fell off the edge and died. Maybe that wasn't such a bad thing.");
-        glfwSetWindowShouldClose(window, GL_TRUE);
+        if ( playerPos(p, &x, &z) && (x > 100 || x < -100 || z > 100 || z < -100) )
+            playerDied(p, CAUSE_EDGE, "You fell off the edge and died. Maybe that wasn't such a bad thing.");
     }
     
     if ( ticks%2 == 0)
-        makeEnemies();
+        for ( p=0 ; p<playerCount() ; p++ )
+            if ( playerPos(p, &x, &z) )
+                makeEnemies(x, z);
     if ( ticks%500 == 0 )
         enemy_speed += 0.5f;
     
     ticks++;
     
-    timer = glfwGetTime();
-    
     if ( timer > 60 ) {
-        DIE("Time is up. Disappointing.");
-        glfwSetWindowShouldClose(window, GL_TRUE);
+        if ( server_mode )
+            DIE(CAUSE_TIME, "Time is up. Disappointing.");
+        else
+            playerDied(0, CAUSE_TIME, "Time is up. Disappointing.");
     }
     
     moveEnemies();
     moveProjectiles();
     
-    if ( fabs(pos_x - objective.x) < 1.0f && fabs(pos_z - objective.y) < 1.0f )
+    for ( p=0 ; p<playerCount() ; p++ )
     {
-        score += objective.score;
-        initial_enemy_speed *= 1.5f;
-        movement_speed *= 1.075f;
-        DIE("You got to the objective. Your parents will finally be proud of you.");
+        if ( playerPos(p, &x, &z) && fabs(x - objective.x) < 1.0f && fabs(z - objective.y) < 1.0f )
+        {
+            logEvent(EVENT_OBJECTIVE, p, CAUSE_NONE, x, z, objective.score, 0);
+            playerScored(p, objective.score);
+            initial_enemy_speed *= 1.5f;
+            movement_speed *= 1.075f;
+            DIE(CAUSE_OBJECTIVE, "You got to the objective. Your parents will finally be proud of you.");
+            break;
+        }
+    }
+}
+
+int playerCount()
+{
+    return server_mode ? MAX_PLAYERS : 1;
+}
+
+bool playerPos(int p, float *x, float *z)
+{
+    if ( !server_mode ) {
+        *x = pos_x;
+        *z = pos_z;
+        return true;
     }
+    
+    *x = players[p].x;
+    *z = players[p].z;
+    return players[p].active;
+}
 
-    char title[256];
-    #ifdef _WIN32
-        sprintf_s(title, "LD28 - You only have one @ %.1f FPS", (float)getFPS());
-    #else
-        snprintf(title, 256, "LD28 - You only have one @ %.1f FPS", (float)getFPS());
-    #endif
-    glfwSetWindowTitle(window, title);
+bool nearPlayer(float x, float y, float range)
+{
+    int p;
+    float px, pz;
+    for ( p=0 ; p<playerCount() ; p++ )
+        if ( playerPos(p, &px, &pz) && fabs(x - px) <= range && fabs(y - pz) <= range )
+            return true;
+    
+    return false;
 }
 
-void get_input()
+void playerDied(int p, int cause, char *message)
+{
+    float x, z;
+    playerPos(p, &x, &z);
+    logEvent(EVENT_DEATH, p, cause, x, z, 0, server_mode ? players[p].score : score);
+    
+    if ( !server_mode ) {
+        DIE(cause, message);
+        if ( !offscreen )
+            glfwSetWindowShouldClose(window, GL_TRUE);
+        return;
+    }
+    
+    players[p].x = 0.0f;
+    players[p].z = 0.0f;
+    players[p].score = 0;
+}
+
+void playerScored(int p, float points)
+{
+    float x, z;
+    playerPos(p, &x, &z);
+    
+    if ( server_mode ) {
+        players[p].score += points;
+        logEvent(EVENT_SCORE, p, CAUSE_NONE, x, z, points, players[p].score);
+    } else {
+        score += points;
+        logEvent(EVENT_SCORE, p, CAUSE_NONE, x, z, points, score);
+    }
+}
+
+bool isIdle()
+{
+    return !window_focused || window_iconified || !capture_cursor;
+}
+
+void idle()     // blocks instead of spinning, and hands the clock back untouched when play resumes
+{
+    double paused_at = timer;
+    
+    glfwSetWindowTitle(window, "LD28 - You only have one (paused, E to resume)");
+    
+    while ( isIdle() && !glfwWindowShouldClose(window) ) {
+        glfwWaitEventsTimeout(IDLE_WAIT);
+        idleInput();
+    }
+    
+    glfwSetTime(paused_at);
+    tv0 = glfwGetTime();
+    numFrameTimes = 0;
+}
+
+void idleInput()
 {
     if ( glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS ) {
         glfwSetWindowShouldClose(window, GL_TRUE);
     }
-    if ( glfwGetKey(window, 'W') == GLFW_PRESS ) {
-        if ( !grid[(int)(pos_x+100)][(int)(pos_z-0.15f+100)] )
-            pos_z -= movement_speed * Tdel;
-    }
-    if ( glfwGetKey(window, 'S') == GLFW_PRESS ) {
-        if ( !grid[(int)(pos_x+100)][(int)ceil(pos_z+0.15f+100-1)] )
-            pos_z += movement_speed * Tdel;
+    if ( keyPressed('E') && window_focused ) {
+        capture_cursor = true;
     }
-    if ( glfwGetKey(window, 'A') == GLFW_PRESS ) {
-        if ( !grid[(int)(pos_x-0.15f+100)][(int)(pos_z+100)] )
-            pos_x -= movement_speed * Tdel;
+    
+    if ( !isIdle() )
+        glfwSetCursorPos(window, width/2, height/2);
+}
+
+void get_input()
+{
+    get_common_input();
+    
+    if ( glfwGetKey(window, 'R') == GLFW_PRESS ) {
+        DIE(CAUSE_RESTART, "Creating new level. Wuss...");
     }
-    if ( glfwGetKey(window, 'D') == GLFW_PRESS ) {
-        if ( !grid[(int)ceil(pos_x+0.15f+100-1)][(int)(pos_z+100)] )
-            pos_x += movement_speed * Tdel;
+    if ( keyPressed(GLFW_KEY_F5) ) {
+        saveStateFile(SAVE_FILE);
     }
-    if ( glfwGetKey(window, 'E') == GLFW_PRESS ) {
-        capture_cursor = !capture_cursor;
-        sleepytime(999999999);
+    if ( keyPressed(GLFW_KEY_F9) ) {
+        if ( loadStateFile(SAVE_FILE) )
+            resumeState();
     }
-    if ( glfwGetKey(window, 'R') == GLFW_PRESS ) {
-        DIE("Creating new level. Wuss...");
+    if ( keyPressed(GLFW_KEY_BACKSPACE) ) {
+        if ( popRewind() )
+            resumeState();
     }
     
-    if ( glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS ) {
-        if ( ticks%5 == 0 )
-            addProjectile(pos_x+cosf(DEG2RAD(-rot_y))/4, pos_z+sinf(DEG2RAD(-rot_y))/4);
+    int buttons = readButtons();
+    movePlayer(&pos_x, &pos_z, rot_y, buttons);
+    firePlayer(pos_x, pos_z, rot_y, buttons, 0);
+}
+
+void get_common_input()     // everything that stays local when playing over the network
+{
+    if ( glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS ) {
+        glfwSetWindowShouldClose(window, GL_TRUE);
+    }
+    if ( keyPressed('E') ) {
+        capture_cursor = !capture_cursor;
     }
     
     if ( glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS ) {
@@ -358,29 +1174,85 @@ void get_input()
         rot_y = -RAD2DEG(atan2(cursor_y, cursor_x));
         glfwSetCursorPos(window, width/2, height/2);
     }
-    if ( glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS ) {
-        if ( ticks%4 == 0 )
-            addProjectile(pos_x+cosf(DEG2RAD(-rot_y))/4, pos_z+sinf(DEG2RAD(-rot_y))/4);
-    }
-    if ( glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS ) {
-        
-        if ( !grid[(int)(pos_x+100)][(int)(pos_z-0.15f+100)] && rot_y > 0.0f ){         // W
-            pos_z -= sinf(DEG2RAD(rot_y)) * movement_speed * Tdel;
-        }
-        if ( !grid[(int)(pos_x+100)][(int)ceil(pos_z+0.2f+100-1)] && rot_y < 0.0f) {  // S
-            pos_z -= sinf(DEG2RAD(rot_y)) * movement_speed * Tdel;
-        }
-        if ( !grid[(int)(pos_x-0.2f+100)][(int)(pos_z+100)] && (rot_y > 90.0f || rot_y < -90.0f) ) {        // A
-            pos_x += cosf(DEG2RAD(rot_y)) * movement_speed * Tdel;
-        }
-        if ( !grid[(int)ceil(pos_x+0.15f+100-1)][(int)(pos_z+100)] && rot_y < 90.0f && rot_y > -90.0f ) {  // D
-            pos_x += cosf(DEG2RAD(rot_y)) * movement_speed * Tdel;
-        }
-    }
+}
+
+int readButtons()
+{
+    int buttons = 0;
+    
+    if ( glfwGetKey(window, 'W') == GLFW_PRESS )
+        buttons |= INPUT_UP;
+    if ( glfwGetKey(window, 'S') == GLFW_PRESS )
+        buttons |= INPUT_DOWN;
+    if ( glfwGetKey(window, 'A') == GLFW_PRESS )
+        buttons |= INPUT_LEFT;
+    if ( glfwGetKey(window, 'D') == GLFW_PRESS )
+        buttons |= INPUT_RIGHT;
+    if ( glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS )
+        buttons |= INPUT_SHOOT_KEY;
+    if ( glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS )
+        buttons |= INPUT_SHOOT;
+    if ( glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS )
+        buttons |= INPUT_FORWARD;
+    
+    return buttons;
+}
+
+void movePlayer(float *x, float *z, float rot, int buttons)
+{
+    if ( buttons & INPUT_UP ) {
+        if ( !grid[(int)(*x+100)][(int)(*z-0.15f+100)] )
+            *z -= movement_speed * Tdel;
+    }
+    if ( buttons & INPUT_DOWN ) {
+        if ( !grid[(int)(*x+100)][(int)ceil(*z+0.15f+100-1)] )
+            *z += movement_speed * Tdel;
+    }
+    if ( buttons & INPUT_LEFT ) {
+        if ( !grid[(int)(*x-0.15f+100)][(int)(*z+100)] )
+            *x -= movement_speed * Tdel;
+    }
+    if ( buttons & INPUT_RIGHT ) {
+        if ( !grid[(int)ceil(*x+0.15f+100-1)][(int)(*z+100)] )
+            *x += movement_speed * Tdel;
+    }
+    if ( buttons & INPUT_FORWARD ) {
+        
+        if ( !grid[(int)(*x+100)][(int)(*z-0.15f+100)] && rot > 0.0f ){         // W
+            *z -= sinf(DEG2RAD(rot)) * movement_speed * Tdel;
+        }
+        if ( !grid[(int)(*x+100)][(int)ceil(*z+0.2f+100-1)] && rot < 0.0f) {  // S
+            *z -= sinf(DEG2RAD(rot)) * movement_speed * Tdel;
+        }
+        if ( !grid[(int)(*x-0.2f+100)][(int)(*z+100)] && (rot > 90.0f || rot < -90.0f) ) {        // A
+            *x += cosf(DEG2RAD(rot)) * movement_speed * Tdel;
+        }
+        if ( !grid[(int)ceil(*x+0.15f+100-1)][(int)(*z+100)] && rot < 90.0f && rot > -90.0f ) {  // D
+            *x += cosf(DEG2RAD(rot)) * movement_speed * Tdel;
+        }
+    }
+}
+
+void firePlayer(float x, float z, float rot, int buttons, int owner)
+{
+    if ( (buttons & INPUT_SHOOT_KEY) && ticks%5 == 0 )
+        addProjectile(x+cosf(DEG2RAD(-rot))/4, z+sinf(DEG2RAD(-rot))/4, -rot, owner);
+    if ( (buttons & INPUT_SHOOT) && ticks%4 == 0 )
+        addProjectile(x+cosf(DEG2RAD(-rot))/4, z+sinf(DEG2RAD(-rot))/4, -rot, owner);
+}
+
+bool keyPressed(int key)
+{
+    bool down = glfwGetKey(window, key) == GLFW_PRESS;
+    bool pressed = down && !key_state[key];
+    key_state[key] = down;
+    
+    return pressed;
 }
 
 void render()
 {
+    beginFrame();
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 
     glLoadIdentity();
@@ -405,7 +1277,7 @@ void render()
     
         int i;
         glColor3f(5.0f/max(pos_y, 4), 5.0f/max(pos_y, 4), 5.0f/max(pos_y, 4));
-        for ( i=-100 ; i<100 ; i++ ) {
+        for ( i=-100 ; i<100 ; i+=quality_levels[quality_level].grid_step ) {
             glVertex3f(i, -0.1f, -100.0f);
             glVertex3f(i, -0.1f,  100.0f);
             glVertex3f(-100.0f, -0.1f, i);
@@ -457,6 +1329,8 @@ void render()
         drawBuildings();
     glEnd();
     
+    drawPlayers();
+    
     glPushMatrix();
     
     glTranslatef(pos_x, 0.0f, pos_z);
@@ -531,7 +1405,7 @@ void render()
     glPopMatrix();
 
     glPopMatrix();
-    glfwSwapBuffers(window);
+    endFrame();
 }
 
 void makeBuildings(int buildingCount)
@@ -543,16 +1417,17 @@ void makeBuildings(int buildingCount)
         }
     }
     
+    numBuildings = 0;
     for ( i=0 ; i<buildingCount ; i++ )
     {
         Building tmp;
-        tmp.x = rand()%200 - 100;
-        tmp.y = rand()%200 - 100;
+        tmp.x = gameRand()%200 - 100;
+        tmp.y = gameRand()%200 - 100;
         
         if ( tmp.x < 5 && tmp.x > -5 && tmp.y < 5 && tmp.y > -5)
             continue;
         
-        int size = rand()%190/10+1;
+        int size = gameRand()%190/10+1;
         int ds = 1;
 
         if ( size > 10 )
@@ -571,23 +1446,23 @@ void makeBuildings(int buildingCount)
             }
         }
         
-        buildings[i] = tmp;
+        buildings[numBuildings++] = tmp;
     }
 }
 
-void makeEnemies()
+void makeEnemies(float around_x, float around_y)
 {
     int i;
     for ( i=0 ; i<MAX_ENEMIES ; i++ )
     {
         if ( !enemies[i].alive )
         {
-            int x = (int)pos_x + (rand()%6 + 4) * -1*((rand()%2)*2-1);
-            int y = (int)pos_z + (rand()%6 + 4) * -1*((rand()%2)*2-1);
+            int x = (int)around_x + (gameRand()%6 + 4) * -1*((gameRand()%2)*2-1);
+            int y = (int)around_y + (gameRand()%6 + 4) * -1*((gameRand()%2)*2-1);
 
             enemies[i].x = x;
             enemies[i].y = y;
-            enemies[i].direction = rand()%4;
+            enemies[i].direction = gameRand()%4;
             enemies[i].alive = true;
 
             break;
@@ -595,12 +1470,13 @@ void makeEnemies()
     }
 }
 
-void addProjectile(float x, float y)
+void addProjectile(float x, float y, float angle, int owner)
 {
     Projectile tmp;
     tmp.x = x;
     tmp.y = y;
-    tmp.angle = -rot_y;
+    tmp.angle = angle;
+    tmp.owner = owner;
     tmp.alive = true;
     tmp.alive_time = 0.0f;
     
@@ -633,12 +1509,23 @@ void moveProjectiles()
             {
                 projectiles[i].alive = false;
             }
-            if ( fabs(projectiles[i].x - pos_x) < 0.075f && fabs(projectiles[i].y - pos_z) < 0.075f )
+            int p;
+            float x, z;
+            bool hit = false;
+            for ( p=0 ; p<playerCount() ; p++ )
             {
-                DIE("You just ran right into your own bullet. You cheating bastard.");
-                glfwSetWindowShouldClose(window, GL_TRUE);
-                break;
+                if ( playerPos(p, &x, &z) && fabs(projectiles[i].x - x) < 0.075f && fabs(projectiles[i].y - z) < 0.075f )
+                {
+                    playerDied(p, CAUSE_BULLET, "You just ran right into your own bullet. You cheating bastard.");
+                    hit = true;
+                }
+            }
+            if ( hit && server_mode ) {         // only that player respawns, the rest of the projectiles keep flying
+                projectiles[i].alive = false;
+                continue;
             }
+            if ( hit )
+                break;
             
             int j;
             for ( j=0 ; j<MAX_ENEMIES ; j++ )
@@ -647,7 +1534,8 @@ void moveProjectiles()
                 {
                     if ( fabs(projectiles[i].x - enemies[j].x) < 0.1f && fabs(projectiles[i].y - enemies[j].y) < 0.1f ) {
                         enemies[j].alive = false;
-                        score += initial_enemy_speed;
+                        logEvent(EVENT_KILL, projectiles[i].owner, CAUSE_NONE, enemies[j].x, enemies[j].y, initial_enemy_speed, 0);
+                        playerScored(projectiles[i].owner, initial_enemy_speed);
                         break;
                     }
                 }
@@ -680,7 +1568,7 @@ void moveEnemies()
                     break;
             }
             
-            if ( fabs(enemies[i].x - pos_x) > 32 || fabs(enemies[i].y - pos_z) > 32 ) {
+            if ( !nearPlayer(enemies[i].x, enemies[i].y, 32) ) {
                 enemies[i].alive = false;
                 break;
             }
@@ -693,25 +1581,37 @@ void moveEnemies()
                 break;
             }
             
-            if ( fabs(enemies[i].x - pos_x) < 0.1f && fabs(enemies[i].y - pos_z) < 0.1f )
+            int p;
+            float x, z;
+            for ( p=0 ; p<playerCount() ; p++ )
             {
-                DIE("You gave that square a hug. He gave you a hug. Now you are dead. Congratulations.");
-                glfwSetWindowShouldClose(window, GL_TRUE);
+                if ( playerPos(p, &x, &z) && fabs(enemies[i].x - x) < 0.1f && fabs(enemies[i].y - z) < 0.1f )
+                    playerDied(p, CAUSE_ENEMY, "You gave that square a hug. He gave you a hug. Now you are dead. Congratulations.");
             }
         }
     }
 }
 
-void DIE(char *message)
+void DIE(int cause, char *message)
 {
+    building_seed = next_seed;
+    enemy_speed = initial_enemy_speed;
+    
+    if ( server_mode )          // the local player's position and score mean nothing on a server
+        logEvent(EVENT_LEVEL, 0, cause, 0.0f, 0.0f, building_seed, 0);
+    else
+        logEvent(EVENT_LEVEL, 0, cause, pos_x, pos_z, building_seed, score);
+
+    if ( server_mode ) {        // no stdio on the server's tick, the event log has it
+        serverSetup();
+        return;
+    }
+    
     printf("%s\n", message);
     printf("Score: %i\n", score);
+    if ( !offscreen )
+        sleepytime(99999999);
     
-    sleepytime(99999999);
-    
-    building_seed = next_seed;
-    enemy_speed = initial_enemy_speed;
-
     setup();
 }
 
@@ -756,6 +1656,9 @@ void drawBuildings()
     }
     glEnd();
     
+    if ( !quality_levels[quality_level].outlines )
+        return;
+    
     glColor3f(0.0f, 0.0f, 0.0f);
     glBegin(GL_LINES);
     for ( i=0 ; i<numBuildings ; i++ ) {
@@ -786,17 +1689,1932 @@ void drawBuildings()
     glEnd();
 }
 
-void cleanup()
+void drawPlayers()
 {
-    glfwTerminate();
+    glColor3f(0.4f, 0.6f, 1.0f);
+    glBegin(GL_QUADS);
+
+    int p;
+    for ( p=0 ; p<MAX_PLAYERS ; p++ ) {
+        if ( !players[p].active || p == local_player )
+            continue;
+        
+        float x = players[p].x;
+        float y = players[p].z;
+        
+        glVertex3f(-0.1f + x, 0.0f, -0.1f + y);
+        glVertex3f(-0.1f + x, 0.0f,  0.1f + y);
+        glVertex3f( 0.1f + x, 0.0f,  0.1f + y);
+        glVertex3f( 0.1f + x, 0.0f, -0.1f + y);
+    }
+    glEnd();
 }
 
-void scroll_callback(GLFWwindow *window, double xoffset, double yoffset)
+GLFWglproc getProcAddress(const char *name)
 {
-    if ( yoffset < 0 && pos_y < 128 )
-        pos_y /= -yoffset/1.1f;
-    else if ( yoffset > 0 && pos_y > 4 )
-        pos_y *= yoffset/1.1f;
+#ifndef _WIN32
+    if ( egl_display != EGL_NO_DISPLAY )
+        return (GLFWglproc)eglGetProcAddress(name);
+#endif
+    return glfwGetProcAddress(name);
+}
+
+bool extensionSupported(const char *name)
+{
+#ifndef _WIN32
+    if ( egl_display != EGL_NO_DISPLAY ) {
+        const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+        return extensions && strstr(extensions, name);
+    }
+#endif
+    return glfwExtensionSupported(name);
+}
+
+bool loadFramebufferFunctions()
+{
+    if ( !extensionSupported("GL_ARB_framebuffer_object") )
+        return false;
+    
+    pglGenFramebuffers = (PFNGLGENFRAMEBUFFERSPROC)getProcAddress("glGenFramebuffers");
+    pglDeleteFramebuffers = (PFNGLDELETEFRAMEBUFFERSPROC)getProcAddress("glDeleteFramebuffers");
+    pglBindFramebuffer = (PFNGLBINDFRAMEBUFFERPROC)getProcAddress("glBindFramebuffer");
+    pglGenRenderbuffers = (PFNGLGENRENDERBUFFERSPROC)getProcAddress("glGenRenderbuffers");
+    pglDeleteRenderbuffers = (PFNGLDELETERENDERBUFFERSPROC)getProcAddress("glDeleteRenderbuffers");
+    pglBindRenderbuffer = (PFNGLBINDRENDERBUFFERPROC)getProcAddress("glBindRenderbuffer");
+    pglRenderbufferStorageMultisample = (PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC)getProcAddress("glRenderbufferStorageMultisample");
+    pglFramebufferRenderbuffer = (PFNGLFRAMEBUFFERRENDERBUFFERPROC)getProcAddress("glFramebufferRenderbuffer");
+    pglCheckFramebufferStatus = (PFNGLCHECKFRAMEBUFFERSTATUSPROC)getProcAddress("glCheckFramebufferStatus");
+    pglBlitFramebuffer = (PFNGLBLITFRAMEBUFFERPROC)getProcAddress("glBlitFramebuffer");
+    
+    return pglGenFramebuffers && pglDeleteFramebuffers && pglBindFramebuffer &&
+           pglGenRenderbuffers && pglDeleteRenderbuffers && pglBindRenderbuffer &&
+           pglRenderbufferStorageMultisample && pglFramebufferRenderbuffer &&
+           pglCheckFramebufferStatus && pglBlitFramebuffer;
+}
+
+void deleteFramebuffers()
+{
+    if ( fbo_samples >= 0 ) {
+        GLuint fbos[2] = { msaa_fbo, resolve_fbo };
+        GLuint rbos[4] = { msaa_color, msaa_depth, resolve_color, resolve_depth };
+        pglDeleteFramebuffers(2, fbos);
+        pglDeleteRenderbuffers(4, rbos);
+    }
+    
+    fbo_width = fbo_height = 0;
+    fbo_samples = -1;
+}
+
+void resizeFramebuffers(int w, int h, int samples)
+{
+    deleteFramebuffers();
+    
+    pglGenFramebuffers(1, &msaa_fbo);
+    pglGenFramebuffers(1, &resolve_fbo);
+    pglGenRenderbuffers(1, &msaa_color);
+    pglGenRenderbuffers(1, &msaa_depth);
+    pglGenRenderbuffers(1, &resolve_color);
+    pglGenRenderbuffers(1, &resolve_depth);
+    
+    int s = samples < max_samples ? samples : max_samples;
+    
+    pglBindRenderbuffer(GL_RENDERBUFFER, msaa_color);
+    pglRenderbufferStorageMultisample(GL_RENDERBUFFER, s, GL_RGBA8, w, h);
+    pglBindRenderbuffer(GL_RENDERBUFFER, msaa_depth);
+    pglRenderbufferStorageMultisample(GL_RENDERBUFFER, s, GL_DEPTH_COMPONENT24, w, h);
+    pglBindFramebuffer(GL_FRAMEBUFFER, msaa_fbo);
+    pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, msaa_color);
+    pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, msaa_depth);
+    bool complete = pglCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    
+    pglBindRenderbuffer(GL_RENDERBUFFER, resolve_color);
+    pglRenderbufferStorageMultisample(GL_RENDERBUFFER, 0, GL_RGBA8, w, h);
+    pglBindRenderbuffer(GL_RENDERBUFFER, resolve_depth);
+    pglRenderbufferStorageMultisample(GL_RENDERBUFFER, 0, GL_DEPTH_COMPONENT24, w, h);
+    pglBindFramebuffer(GL_FRAMEBUFFER, resolve_fbo);
+    pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolve_color);
+    pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, resolve_depth);
+    complete = complete && pglCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    
+    pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+    pglBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    fbo_samples = samples;
+    
+    if ( !complete ) {
+        fprintf(stderr, "Offscreen framebuffer incomplete, rendering straight to the window\n");
+        deleteFramebuffers();
+        fbo_supported = false;
+        return;
+    }
+    
+    fbo_width = w;
+    fbo_height = h;
+}
+
+void beginFrame()       // MSAA and resolution scaling both go through the offscreen framebuffers
+{
+    QualityLevel *q = &quality_levels[quality_level];
+    
+    fbo_bound = fbo_supported && (offscreen || q->samples > 0 || q->scale < 1.0f);
+    if ( !fbo_bound ) {
+        glViewport(0, 0, width, height);
+        return;
+    }
+    
+    int w = width * q->scale;
+    int h = height * q->scale;
+    if ( w < 1 ) w = 1;
+    if ( h < 1 ) h = 1;
+    
+    if ( w != fbo_width || h != fbo_height || q->samples != fbo_samples )
+        resizeFramebuffers(w, h, q->samples);
+    
+    if ( !fbo_supported ) {
+        fbo_bound = false;
+        glViewport(0, 0, width, height);
+        return;
+    }
+    
+    pglBindFramebuffer(GL_FRAMEBUFFER, q->samples > 0 ? msaa_fbo : resolve_fbo);
+    glViewport(0, 0, w, h);
+}
+
+void endFrame()
+{
+    if ( fbo_bound ) {
+        if ( fbo_samples > 0 ) {
+            pglBindFramebuffer(GL_READ_FRAMEBUFFER, msaa_fbo);
+            pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolve_fbo);
+            pglBlitFramebuffer(0, 0, fbo_width, fbo_height, 0, 0, fbo_width, fbo_height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        }
+        
+        if ( offscreen ) {          // the frame stays in resolve_fbo to be read back
+            pglBindFramebuffer(GL_FRAMEBUFFER, resolve_fbo);
+            return;
+        }
+        
+        pglBindFramebuffer(GL_READ_FRAMEBUFFER, resolve_fbo);
+        pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        pglBlitFramebuffer(0, 0, fbo_width, fbo_height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    
+    glfwSwapBuffers(window);
+}
+
+int effectiveSamples(int level)     // what the driver will actually give us
+{
+    return fbo_supported ? min(quality_levels[level].samples, max_samples) : 0;
+}
+
+bool sameQuality(int a, int b)
+{
+    QualityLevel *qa = &quality_levels[a], *qb = &quality_levels[b];
+    float scale_a = fbo_supported ? qa->scale : 1.0f;
+    float scale_b = fbo_supported ? qb->scale : 1.0f;
+    
+    return effectiveSamples(a) == effectiveSamples(b) && scale_a == scale_b &&
+           qa->outlines == qb->outlines && qa->grid_step == qb->grid_step;
+}
+
+int nextQuality(int level, int dir)     // skips levels that look the same on this driver, e.g. 8x and 16x when 4x is the max
+{
+    int l;
+    for ( l=level+dir ; l>=0 && l<NUM_QUALITY_LEVELS ; l+=dir )
+        if ( !sameQuality(l, level) )
+            return l;
+    
+    return level;
+}
+
+void resetQualityBackoff()
+{
+    quality_blocked = -1;
+    quality_backoff = 0;
+    quality_penalty = QUALITY_BACKOFF;
+}
+
+void updateQuality(double frame_time)
+{
+    if ( frame_time > 0.25 )        // level loads and the death pause aren't rendering cost
+        return;
+    
+    frame_times[numFrameTimes++] = frame_time;
+    if ( numFrameTimes < QUALITY_WINDOW )
+        return;
+    numFrameTimes = 0;
+    
+    double average = 0.0;
+    int i;
+    for ( i=0 ; i<QUALITY_WINDOW ; i++ )
+        average += frame_times[i];
+    average /= QUALITY_WINDOW;
+    
+    if ( quality_backoff > 0 )
+        quality_backoff--;
+    
+    int level = quality_level;
+    if ( average > QUALITY_DOWN / TARGET_FPS ) {
+        level = nextQuality(quality_level, -1);
+        if ( level != quality_level ) {         // don't come straight back to the level that just failed
+            if ( quality_blocked == quality_level )
+                quality_penalty = min(quality_penalty*2, QUALITY_BACKOFF_MAX);
+            else
+                quality_penalty = QUALITY_BACKOFF;
+            quality_blocked = nextQuality(level, 1);
+            quality_backoff = quality_penalty;
+        }
+    }
+    else if ( average < QUALITY_UP / TARGET_FPS ) {
+        level = nextQuality(quality_level, 1);
+        if ( level == quality_blocked && quality_backoff > 0 )
+            level = quality_level;
+    }
+    
+    if ( level == quality_level )
+        return;
+    
+    quality_level = level;
+    
+    QualityLevel *q = &quality_levels[quality_level];
+    printf("Quality level %i (%.1f ms/frame): %ix MSAA, %.0f%% resolution, outlines %s, grid every %i\n",
+           quality_level, average*1000, effectiveSamples(quality_level), (fbo_supported ? q->scale : 1.0f)*100,
+           q->outlines ? "on" : "off", q->grid_step);
+}
+
+int gameRand()
+{
+    rand_state = rand_state * 1103515245 + 12345;   // own generator so the RNG state can be saved and restored
+    return (rand_state >> 16) & GAME_RAND_MAX;
+}
+
+void gameSrand(unsigned int seed)
+{
+    rand_state = seed;
+}
+
+size_t maxStateSize()
+{
+    return sizeof(SnapshotHeader) + 200*200/8 +
+           NUM_BUILDINGS * 5*sizeof(float) +
+           MAX_ENEMIES * (sizeof(uint16_t) + 2*sizeof(float) + 1) +
+           MAX_PROJECTILES * (sizeof(uint16_t) + 4*sizeof(float));
+}
+
+#define PUT(p, v) do { memcpy(p, &(v), sizeof(v)); p += sizeof(v); } while(0)
+#define GET(p, v) do { memcpy(&(v), p, sizeof(v)); p += sizeof(v); } while(0)
+
+size_t saveState(unsigned char *buf, size_t capacity)
+{
+    if ( capacity < maxStateSize() )
+        return 0;
+    
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.timer = timer;
+    h.cursor_x = cursor_x;
+    h.cursor_y = cursor_y;
+    h.numBuildings = numBuildings;
+    h.numProjectiles = numProjectiles;
+    h.currentProjectile = currentProjectile;
+    h.building_seed = building_seed;
+    h.next_seed = next_seed;
+    h.rand_state = rand_state;
+    h.ticks = ticks;
+    h.score = score;
+    h.pos_x = pos_x;
+    h.pos_y = pos_y;
+    h.pos_z = pos_z;
+    h.rot_y = rot_y;
+    h.movement_speed = movement_speed;
+    h.enemy_speed = enemy_speed;
+    h.initial_enemy_speed = initial_enemy_speed;
+    h.objective = objective;
+    
+    int i, j;
+    for ( i=0 ; i<MAX_ENEMIES ; i++ )
+        h.numEnemies += enemies[i].alive;
+    for ( i=0 ; i<numProjectiles ; i++ )
+        h.numLiveProjectiles += projectiles[i].alive;
+    
+    unsigned char *p = buf;
+    PUT(p, h);
+    
+    for ( i=0 ; i<200 ; i++ ) {
+        for ( j=0 ; j<200 ; j+=8 ) {
+            unsigned char bits = 0;
+            int k;
+            for ( k=0 ; k<8 ; k++ )
+                bits |= grid[i][j+k] << k;
+            *p++ = bits;
+        }
+    }
+    
+    for ( i=0 ; i<numBuildings ; i++ ) {
+        PUT(p, buildings[i].x);
+        PUT(p, buildings[i].y);
+        PUT(p, buildings[i].x_);
+        PUT(p, buildings[i].y_);
+        PUT(p, buildings[i].height);
+    }
+    
+    for ( i=0 ; i<MAX_ENEMIES ; i++ ) {
+        if ( enemies[i].alive ) {
+            uint16_t index = i;
+            uint8_t direction = enemies[i].direction;
+            PUT(p, index);
+            PUT(p, enemies[i].x);
+            PUT(p, enemies[i].y);
+            PUT(p, direction);
+        }
+    }
+    
+    for ( i=0 ; i<numProjectiles ; i++ ) {
+        if ( projectiles[i].alive ) {
+            uint16_t index = i;
+            PUT(p, index);
+            PUT(p, projectiles[i].x);
+            PUT(p, projectiles[i].y);
+            PUT(p, projectiles[i].angle);
+            PUT(p, projectiles[i].alive_time);
+        }
+    }
+    
+    return p - buf;
+}
+
+bool inLevel(float v)       // positions index grid, so a save must keep them on the map
+{
+    return isfinite(v) && v >= -100.0f && v <= 100.0f;
+}
+
+bool loadState(const unsigned char *buf, size_t size)
+{
+    SnapshotHeader h;
+    
+    if ( size < sizeof(h) )
+        return false;
+    
+    const unsigned char *p = buf;
+    GET(p, h);
+    
+    if ( h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION )
+        return false;
+    if ( h.numBuildings > NUM_BUILDINGS || h.numEnemies > MAX_ENEMIES ||
+         h.numProjectiles > MAX_PROJECTILES || h.numLiveProjectiles > h.numProjectiles ||
+         h.currentProjectile >= MAX_PROJECTILES )
+        return false;
+    if ( !inLevel(h.pos_x) || !inLevel(h.pos_z) || !inLevel(h.objective.x) || !inLevel(h.objective.y) )
+        return false;
+    if ( size != sizeof(h) + 200*200/8 + h.numBuildings * 5*sizeof(float) +
+                 h.numEnemies * (sizeof(uint16_t) + 2*sizeof(float) + 1) +
+                 h.numLiveProjectiles * (sizeof(uint16_t) + 4*sizeof(float)) )
+        return false;
+    
+    int i, j;
+    const unsigned char *q = p + 200*200/8 + h.numBuildings * 5*sizeof(float);     // check every entity record before touching the level
+    for ( i=0 ; i<h.numEnemies ; i++ ) {
+        uint16_t index;
+        float x, y;
+        uint8_t direction;
+        GET(q, index);
+        GET(q, x);
+        GET(q, y);
+        GET(q, direction);
+        if ( index >= MAX_ENEMIES || direction >= 4 || !inLevel(x) || !inLevel(y) )
+            return false;
+    }
+    for ( i=0 ; i<h.numLiveProjectiles ; i++ ) {
+        uint16_t index;
+        float x, y;
+        GET(q, index);
+        GET(q, x);
+        GET(q, y);
+        q += 2*sizeof(float);
+        if ( index >= h.numProjectiles || !inLevel(x) || !inLevel(y) )
+            return false;
+    }
+    
+    for ( i=0 ; i<200 ; i++ ) {
+        for ( j=0 ; j<200 ; j+=8 ) {
+            unsigned char bits = *p++;
+            int k;
+            for ( k=0 ; k<8 ; k++ )
+                grid[i][j+k] = (bits >> k) & 1;
+        }
+    }
+    
+    numBuildings = h.numBuildings;
+    for ( i=0 ; i<numBuildings ; i++ ) {
+        GET(p, buildings[i].x);
+        GET(p, buildings[i].y);
+        GET(p, buildings[i].x_);
+        GET(p, buildings[i].y_);
+        GET(p, buildings[i].height);
+    }
+    
+    for ( i=0 ; i<MAX_ENEMIES ; i++ )
+        enemies[i].alive = false;
+    for ( i=0 ; i<h.numEnemies ; i++ ) {
+        uint16_t index;
+        uint8_t direction;
+        GET(p, index);
+        GET(p, enemies[index].x);
+        GET(p, enemies[index].y);
+        GET(p, direction);
+        enemies[index].direction = direction;
+        enemies[index].alive = true;
+    }
+    
+    for ( i=0 ; i<MAX_PROJECTILES ; i++ )
+        projectiles[i].alive = false;
+    for ( i=0 ; i<h.numLiveProjectiles ; i++ ) {
+        uint16_t index;
+        GET(p, index);
+        GET(p, projectiles[index].x);
+        GET(p, projectiles[index].y);
+        GET(p, projectiles[index].angle);
+        GET(p, projectiles[index].alive_time);
+        projectiles[index].owner = 0;
+        projectiles[index].alive = true;
+    }
+    
+    timer = h.timer;
+    cursor_x = h.cursor_x;
+    cursor_y = h.cursor_y;
+    numProjectiles = h.numProjectiles;
+    currentProjectile = h.currentProjectile;
+    building_seed = h.building_seed;
+    next_seed = h.next_seed;
+    rand_state = h.rand_state;
+    ticks = h.ticks;
+    score = h.score;
+    pos_x = h.pos_x;
+    pos_y = h.pos_y;
+    pos_z = h.pos_z;
+    rot_y = h.rot_y;
+    movement_speed = h.movement_speed;
+    enemy_speed = h.enemy_speed;
+    initial_enemy_speed = h.initial_enemy_speed;
+    objective = h.objective;
+    
+    return true;
+}
+
+#undef PUT
+#undef GET
+
+bool captureState(Snapshot *snap)
+{
+    if ( snap->capacity < maxStateSize() ) {
+        unsigned char *data = realloc(snap->data, maxStateSize());
+        if ( !data )
+            return false;
+        snap->data = data;
+        snap->capacity = maxStateSize();
+    }
+    
+    snap->size = saveState(snap->data, snap->capacity);
+    return snap->size > 0;
+}
+
+void resumeState()      // the restored timer becomes the level clock, and the next Tdel starts from now
+{
+    glfwSetTime(timer);
+    tv0 = glfwGetTime();
+}
+
+bool saveStateFile(const char *path)
+{
+    Snapshot snap = {NULL, 0, 0};
+    bool ok = false;
+    
+    if ( captureState(&snap) ) {
+        FILE *f = fopen(path, "wb");
+        if ( f ) {
+            ok = fwrite(snap.data, 1, snap.size, f) == snap.size;
+            ok = (fclose(f) == 0) && ok;
+        }
+    }
+    
+    if ( ok )
+        printf("Saved state to %s (%u bytes)\n", path, (unsigned)snap.size);
+    else
+        fprintf(stderr, "Could not save state to %s\n", path);
+    
+    free(snap.data);
+    return ok;
+}
+
+bool loadStateFile(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if ( !f ) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    
+    size_t capacity = maxStateSize();
+    unsigned char *buf = malloc(capacity);
+    size_t size = buf ? fread(buf, 1, capacity, f) : 0;
+    fclose(f);
+    
+    bool ok = size > 0 && loadState(buf, size);
+    if ( ok )
+        printf("Loaded state from %s\n", path);
+    else
+        fprintf(stderr, "%s is not a valid save state\n", path);
+    
+    free(buf);
+    return ok;
+}
+
+void pushRewind()
+{
+    Snapshot *snap = &rewind_ring[rewind_head];
+    
+    if ( !captureState(snap) )
+        return;
+    
+    rewind_head = (rewind_head+1) % REWIND_SLOTS;
+    rewind_count = min(rewind_count+1, REWIND_SLOTS);
+}
+
+bool popRewind()        // steps back to the previous snapshot, the level start snapshot is never popped
+{
+    if ( rewind_count == 0 )
+        return false;
+    
+    if ( rewind_count > 1 ) {
+        rewind_head = (rewind_head+REWIND_SLOTS-1) % REWIND_SLOTS;
+        rewind_count--;
+    }
+    
+    Snapshot *snap = &rewind_ring[(rewind_head+REWIND_SLOTS-1) % REWIND_SLOTS];
+    return loadState(snap->data, snap->size);
+}
+
+void benchSnapshots(int iterations)
+{
+    pos_x = pos_z = 0.0f;
+    generateLevel();
+    
+    int i;
+    for ( i=0 ; i<MAX_ENEMIES/4 ; i++ )
+        makeEnemies(pos_x, pos_z);
+    for ( i=0 ; i<MAX_PROJECTILES/4 ; i++ )
+        addProjectile(pos_x, pos_z, i, 0);
+    
+    Snapshot snap = {NULL, 0, 0};
+    clock_t c0 = clock();
+    for ( i=0 ; i<iterations ; i++ )
+        captureState(&snap);
+    clock_t c1 = clock();
+    for ( i=0 ; i<iterations ; i++ )
+        loadState(snap.data, snap.size);
+    clock_t c2 = clock();
+    for ( i=0 ; i<iterations ; i++ )
+        pushRewind();
+    clock_t c3 = clock();
+    
+    printf("Snapshot: %u bytes (max %u), %i enemies, %i projectiles\n",
+           (unsigned)snap.size, (unsigned)maxStateSize(), MAX_ENEMIES/4, MAX_PROJECTILES/4);
+    printf("save:    %.2f us\n", (c1-c0) * 1e6 / CLOCKS_PER_SEC / iterations);
+    printf("restore: %.2f us\n", (c2-c1) * 1e6 / CLOCKS_PER_SEC / iterations);
+    printf("rewind:  %.2f us\n", (c3-c2) * 1e6 / CLOCKS_PER_SEC / iterations);
+    
+    free(snap.data);
+}
+
+double nowSeconds()
+{
+#ifndef _WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return count.QuadPart / (double)frequency.QuadPart;
+#endif
+}
+
+bool netInit()
+{
+#ifdef _WIN32
+    WSADATA wsa;
+    return WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+#else
+    return true;
+#endif
+}
+
+SOCKET netOpen(uint32_t address, int port)
+{
+    if ( !netInit() )
+        return INVALID_SOCKET;
+    
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if ( sock == INVALID_SOCKET )
+        return INVALID_SOCKET;
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(address);
+    addr.sin_port = htons(port);
+    
+    if ( bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    
+#ifndef _WIN32
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#else
+    u_long nonblocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonblocking);
+#endif
+    
+    return sock;
+}
+
+void netWait(SOCKET sock, double seconds)   // sleeps until a packet arrives or the time runs out
+{
+    if ( seconds <= 0.0 )
+        return;
+    
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    
+    struct timeval tv;
+    tv.tv_sec = (long)seconds;
+    tv.tv_usec = (long)((seconds - tv.tv_sec) * 1e6);
+    
+    select(sock+1, &fds, NULL, NULL, &tv);
+}
+
+void netPut16(unsigned char **p, int v)
+{
+    (*p)[0] = v & 0xFF;
+    (*p)[1] = (v >> 8) & 0xFF;
+    *p += 2;
+}
+
+void netPut32(unsigned char **p, int32_t v)
+{
+    netPut16(p, v & 0xFFFF);
+    netPut16(p, ((uint32_t)v >> 16) & 0xFFFF);
+}
+
+int netGet16(const unsigned char **p)
+{
+    int v = (*p)[0] | ((*p)[1] << 8);
+    *p += 2;
+    return v;
+}
+
+int32_t netGet32(const unsigned char **p)
+{
+    uint32_t lo = netGet16(p);
+    uint32_t hi = netGet16(p);
+    return (int32_t)(lo | (hi << 16));
+}
+
+int16_t netQuantize(float v)
+{
+    float q = floorf(v * NET_POS_SCALE + 0.5f);
+    
+    if ( q > 32767.0f ) q = 32767.0f;
+    if ( q < -32767.0f ) q = -32767.0f;
+    
+    return (int16_t)q;
+}
+
+void buildView(NetView *v, float x, float z)
+{
+    v->count = 0;
+    
+    int i;
+    for ( i=0 ; i<MAX_ENEMIES ; i++ ) {
+        if ( enemies[i].alive && fabs(enemies[i].x - x) <= NET_VIEW_RANGE && fabs(enemies[i].y - z) <= NET_VIEW_RANGE ) {
+            NetEntity *e = &v->entities[v->count++];
+            e->id = i;
+            e->x = netQuantize(enemies[i].x);
+            e->y = netQuantize(enemies[i].y);
+            e->extra = enemies[i].direction;
+        }
+    }
+    for ( i=0 ; i<numProjectiles ; i++ ) {
+        if ( projectiles[i].alive && fabs(projectiles[i].x - x) <= NET_VIEW_RANGE && fabs(projectiles[i].y - z) <= NET_VIEW_RANGE ) {
+            NetEntity *e = &v->entities[v->count++];
+            e->id = MAX_ENEMIES + i;
+            e->x = netQuantize(projectiles[i].x);
+            e->y = netQuantize(projectiles[i].y);
+            e->extra = min(projectiles[i].alive_time * 16, 255);
+        }
+    }
+}
+
+size_t encodeSnapshot(unsigned char *buf, int p, const NetView *view)     // deltas against the last snapshot the client acked
+{
+    Player *pl = &players[p];
+    uint16_t seq = ++pl->seq;
+    
+    const NetView *base = NULL;
+    if ( pl->has_ack && (uint16_t)(seq - pl->acked) < NET_HISTORY ) {
+        base = &pl->history[pl->acked % NET_HISTORY];
+        if ( !base->valid || base->seq != pl->acked )
+            base = NULL;
+    }
+    
+    NetView *sent = &pl->history[seq % NET_HISTORY];
+    sent->valid = false;
+    sent->count = 0;
+    
+    unsigned char *q = buf;
+    *q++ = NET_SNAPSHOT;
+    netPut16(&q, seq);
+    *q++ = base != NULL;
+    netPut16(&q, base ? base->seq : 0);
+    *q++ = p;
+    netPut32(&q, building_seed);
+    netPut16(&q, (int)(timer * 100));
+    
+    int i, j, n = 0;
+    for ( i=0 ; i<MAX_PLAYERS ; i++ )
+        n += players[i].active;
+    *q++ = n;
+    for ( i=0 ; i<MAX_PLAYERS ; i++ ) {
+        if ( players[i].active ) {
+            *q++ = i;
+            netPut16(&q, netQuantize(players[i].x));
+            netPut16(&q, netQuantize(players[i].z));
+            netPut16(&q, (int)(players[i].rot * 100));
+            netPut32(&q, players[i].score);
+        }
+    }
+    
+    unsigned char *countAt = q;
+    q += 2;
+    int ops = 0;
+    int nb = base ? base->count : 0;
+    
+    i = j = 0;
+    while ( (i < view->count || j < nb) && q - buf < NET_MAX_PACKET - 16 )
+    {
+        const NetEntity *e = i < view->count ? &view->entities[i] : NULL;
+        const NetEntity *b = j < nb ? &base->entities[j] : NULL;
+        
+        if ( b && (!e || b->id < e->id) ) {
+            netPut16(&q, b->id);
+            *q++ = NET_OP_REMOVE;
+            ops++;
+            j++;
+        } else if ( !b || e->id < b->id ) {
+            netPut16(&q, e->id);
+            *q++ = NET_OP_ADD;
+            netPut16(&q, e->x);
+            netPut16(&q, e->y);
+            *q++ = e->extra;
+            sent->entities[sent->count++] = *e;
+            ops++;
+            i++;
+        } else {
+            int dx = e->x - b->x;
+            int dy = e->y - b->y;
+            int flags = 0;
+            
+            if ( dx || dy )
+                flags |= (dx >= -128 && dx <= 127 && dy >= -128 && dy <= 127) ? NET_OP_MOVE8 : NET_OP_MOVE16;
+            if ( e->extra != b->extra )
+                flags |= NET_OP_EXTRA;
+            
+            if ( flags ) {
+                netPut16(&q, e->id);
+                *q++ = flags;
+                if ( flags & NET_OP_MOVE8 ) {
+                    *q++ = (uint8_t)dx;
+                    *q++ = (uint8_t)dy;
+                } else if ( flags & NET_OP_MOVE16 ) {
+                    netPut16(&q, e->x);
+                    netPut16(&q, e->y);
+                }
+                if ( flags & NET_OP_EXTRA )
+                    *q++ = e->extra;
+                ops++;
+            }
+            
+            sent->entities[sent->count++] = *e;
+            i++;
+            j++;
+        }
+    }
+    
+    while ( j < nb )        // out of room, the client keeps whatever it had for the rest
+        sent->entities[sent->count++] = base->entities[j++];
+    
+    netPut16(&countAt, ops);
+    sent->seq = seq;
+    sent->valid = true;
+    
+    return q - buf;
+}
+
+bool decodeSnapshot(NetClient *c, const unsigned char *buf, size_t len, bool apply)
+{
+    const unsigned char *q = buf;
+    const unsigned char *end = buf + len;
+    
+    if ( len < 15 || *q++ != NET_SNAPSHOT )
+        return false;
+    
+    uint16_t seq = netGet16(&q);
+    bool has_base = *q++;
+    uint16_t base_seq = netGet16(&q);
+    int you = *q++;
+    int seed = netGet32(&q);
+    double t = netGet16(&q) / 100.0;
+    
+    if ( c->has_latest && (int16_t)(seq - c->latest) <= 0 )
+        return false;
+    
+    NetView *v = &c->history[seq % NET_HISTORY];
+    const NetView *base = NULL;
+    if ( has_base ) {
+        base = &c->history[base_seq % NET_HISTORY];
+        if ( base == v || !base->valid || base->seq != base_seq )
+            return false;
+    }
+    
+    int n = *q++;
+    if ( n > MAX_PLAYERS || end - q < n*11 + 2 )
+        return false;
+    
+    const unsigned char *roster = q;
+    q += n*11;
+    
+    int ops = netGet16(&q);
+    int nb = base ? base->count : 0;
+    int i, j = 0;
+    
+    v->valid = false;
+    v->count = 0;
+    
+    for ( i=0 ; i<ops ; i++ )
+    {
+        if ( end - q < 3 )
+            return false;
+        
+        int id = netGet16(&q);
+        int flags = *q++;
+        
+        while ( j < nb && base->entities[j].id < id && v->count < NET_MAX_ENTITIES )
+            v->entities[v->count++] = base->entities[j++];
+        
+        if ( flags & NET_OP_REMOVE ) {
+            if ( j < nb && base->entities[j].id == id )
+                j++;
+            continue;
+        }
+        
+        NetEntity e;
+        if ( flags & NET_OP_ADD ) {
+            if ( end - q < 5 )
+                return false;
+            e.id = id;
+            e.x = netGet16(&q);
+            e.y = netGet16(&q);
+            e.extra = *q++;
+        } else {
+            if ( j >= nb || base->entities[j].id != id )
+                return false;
+            e = base->entities[j++];
+            
+            if ( flags & NET_OP_MOVE8 ) {
+                if ( end - q < 2 )
+                    return false;
+                e.x += (int8_t)*q++;
+                e.y += (int8_t)*q++;
+            } else if ( flags & NET_OP_MOVE16 ) {
+                if ( end - q < 4 )
+                    return false;
+                e.x = netGet16(&q);
+                e.y = netGet16(&q);
+            }
+            if ( flags & NET_OP_EXTRA ) {
+                if ( end - q < 1 )
+                    return false;
+                e.extra = *q++;
+            }
+        }
+        
+        if ( v->count >= NET_MAX_ENTITIES || e.id >= NET_MAX_ENTITIES )
+            return false;
+        v->entities[v->count++] = e;
+    }
+    
+    while ( j < nb && v->count < NET_MAX_ENTITIES )
+        v->entities[v->count++] = base->entities[j++];
+    
+    v->seq = seq;
+    v->valid = true;
+    c->latest = seq;
+    c->has_latest = true;
+    c->id = you;
+    
+    if ( !apply )
+        return true;
+    
+    for ( i=0 ; i<MAX_PLAYERS ; i++ )
+        players[i].active = false;
+    for ( i=0 ; i<n ; i++ ) {
+        int id = *roster++;
+        if ( id >= MAX_PLAYERS ) {
+            roster += 10;
+            continue;
+        }
+        players[id].active = true;
+        players[id].x = (int16_t)netGet16(&roster) / NET_POS_SCALE;
+        players[id].z = (int16_t)netGet16(&roster) / NET_POS_SCALE;
+        players[id].rot = (int16_t)netGet16(&roster) / 100.0f;
+        players[id].score = netGet32(&roster);
+    }
+    
+    if ( you < MAX_PLAYERS && players[you].active ) {
+        local_player = you;
+        pos_x = players[you].x;
+        pos_z = players[you].z;
+        score = players[you].score;
+    }
+    
+    if ( seed != building_seed ) {
+        building_seed = seed;
+        generateLevel();
+    }
+    timer = t;
+    
+    applyView(v);
+    return true;
+}
+
+void applyView(const NetView *v)
+{
+    int i;
+    for ( i=0 ; i<MAX_ENEMIES ; i++ )
+        enemies[i].alive = false;
+    for ( i=0 ; i<MAX_PROJECTILES ; i++ )
+        projectiles[i].alive = false;
+    numProjectiles = MAX_PROJECTILES;
+    
+    for ( i=0 ; i<v->count ; i++ ) {
+        const NetEntity *e = &v->entities[i];
+        if ( e->id < MAX_ENEMIES ) {
+            enemies[e->id].x = e->x / NET_POS_SCALE;
+            enemies[e->id].y = e->y / NET_POS_SCALE;
+            enemies[e->id].direction = e->extra;
+            enemies[e->id].alive = true;
+        } else {
+            Projectile *pr = &projectiles[e->id - MAX_ENEMIES];
+            pr->x = e->x / NET_POS_SCALE;
+            pr->y = e->y / NET_POS_SCALE;
+            pr->alive_time = e->extra / 16.0f;
+            pr->alive = true;
+        }
+    }
+}
+
+int addPlayer(const struct sockaddr_in *addr)
+{
+    int p, k;
+    for ( p=0 ; p<MAX_PLAYERS ; p++ )
+    {
+        if ( !players[p].active )
+        {
+            Player *pl = &players[p];
+            pl->addr = *addr;
+            pl->active = true;
+            pl->x = pl->z = pl->rot = 0.0f;
+            pl->buttons = 0;
+            pl->score = 0;
+            pl->last_heard = nowSeconds();
+            pl->input_seq = 0;
+            pl->seq = 0;
+            pl->has_ack = false;
+            pl->bytes_sent = 0;
+            pl->snapshots_sent = 0;
+            pl->sends_failed = 0;
+            for ( k=0 ; k<NET_HISTORY ; k++ )
+                pl->history[k].valid = false;
+            
+            printf("Player %i joined from %s:%i\n", p, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+            return p;
+        }
+    }
+    
+    return -1;
+}
+
+void serverSetup()
+{
+    generateLevel();
+    
+    int i;
+    for ( i=0 ; i<MAX_ENEMIES ; i++ ) {
+        enemies[i].alive = false;
+    }
+    
+    timer = 0;
+    
+    for ( i=0 ; i<MAX_PLAYERS ; i++ ) {
+        players[i].x = 0.0f;
+        players[i].z = 0.0f;
+    }
+}
+
+void serverReceive(SOCKET sock)
+{
+    unsigned char buf[64];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    int n;
+    
+    while ( (n = recvfrom(sock, (char *)buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen)) > 0 )
+    {
+        int p;
+        for ( p=0 ; p<MAX_PLAYERS ; p++ )
+            if ( players[p].active && players[p].addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+                 players[p].addr.sin_port == from.sin_port )
+                break;
+        if ( p == MAX_PLAYERS )
+            p = -1;
+        
+        if ( buf[0] == NET_HELLO ) {
+            if ( p < 0 )
+                p = addPlayer(&from);
+            if ( p >= 0 ) {
+                unsigned char reply[6];
+                unsigned char *q = reply;
+                *q++ = NET_WELCOME;
+                *q++ = p;
+                netPut32(&q, building_seed);
+                sendto(sock, (char *)reply, sizeof(reply), 0, (struct sockaddr *)&from, sizeof(from));
+            }
+        } else if ( buf[0] == NET_INPUT && p >= 0 && n >= 9 ) {
+            const unsigned char *q = buf+1;
+            uint16_t seq = netGet16(&q);
+            uint16_t ack = netGet16(&q);
+            bool has_ack = *q++;
+            int buttons = *q++;
+            float rot = (int16_t)netGet16(&q) / 100.0f;
+            
+            if ( (int16_t)(seq - players[p].input_seq) > 0 ) {
+                players[p].input_seq = seq;
+                players[p].buttons = buttons;
+                players[p].rot = rot;
+                if ( has_ack ) {
+                    players[p].acked = ack;
+                    players[p].has_ack = true;
+                }
+            }
+            players[p].last_heard = nowSeconds();
+        }
+        
+        fromlen = sizeof(from);
+    }
+}
+
+void serverTick()
+{
+    int p;
+    for ( p=0 ; p<MAX_PLAYERS ; p++ ) {
+        if ( players[p].active ) {
+            movePlayer(&players[p].x, &players[p].z, players[p].rot, players[p].buttons);
+            firePlayer(players[p].x, players[p].z, players[p].rot, players[p].buttons, p);
+        }
+    }
+    
+    simulate();
+}
+
+void sendSnapshots(SOCKET sock)
+{
+    int p;
+    for ( p=0 ; p<MAX_PLAYERS ; p++ ) {
+        if ( players[p].active ) {
+            buildView(&net_view, players[p].x, players[p].z);
+            size_t n = encodeSnapshot(net_buf, p, &net_view);
+            if ( sendto(sock, (char *)net_buf, n, 0, (struct sockaddr *)&players[p].addr, sizeof(players[p].addr)) == (int)n ) {
+                players[p].bytes_sent += n;
+                players[p].snapshots_sent++;
+            } else {
+                players[p].sends_failed++;
+            }
+        }
+    }
+}
+
+void stopServer(int sig)
+{
+    server_stop = 1;
+}
+
+void runServer(int port)
+{
+    server_mode = true;
+    
+    SOCKET sock = netOpen(INADDR_ANY, port);
+    if ( sock == INVALID_SOCKET ) {
+        fprintf(stderr, "Could not listen on UDP port %i\n", port);
+        exit(EXIT_FAILURE);
+    }
+    
+    printf("Serving level %i on UDP port %i\n", building_seed, port);
+    if ( !openEventLog(EVENT_LOG_FILE) )
+        fprintf(stderr, "Could not open %s, serving without an event log\n", EVENT_LOG_FILE);
+    serverSetup();
+    
+    signal(SIGINT, stopServer);         // Ctrl-C ends the loop so the event log gets flushed and closed
+    signal(SIGTERM, stopServer);
+    
+    double next = nowSeconds();
+    while ( !server_stop )
+    {
+        serverReceive(sock);
+        
+        double now = nowSeconds();
+        if ( now - next > 0.25 )        // fell too far behind, don't try to catch up
+            next = now;
+        
+        while ( now >= next ) {
+            Tdel = TIMEDEL60;
+            timer += TIMEDEL60;
+            serverTick();
+            if ( ticks%NET_SNAPSHOT_INTERVAL == 0 )
+                sendSnapshots(sock);
+            next += TIMEDEL60;
+        }
+        
+        int p;
+        for ( p=0 ; p<MAX_PLAYERS ; p++ ) {
+            if ( players[p].active && now - players[p].last_heard > NET_TIMEOUT ) {
+                printf("Player %i timed out. Score: %i\n", p, players[p].score);
+                players[p].active = false;
+            }
+        }
+        
+        netWait(sock, next - nowSeconds());
+    }
+    
+    printf("Shutting down after %i ticks\n", ticks);
+    closeEventLog();
+    closesocket(sock);
+}
+
+bool clientOpen(NetClient *c, const char *host, int port)
+{
+    memset(&c->server, 0, sizeof(c->server));
+    c->server.sin_family = AF_INET;
+    c->server.sin_port = htons(port);
+    if ( inet_pton(AF_INET, host, &c->server.sin_addr) != 1 )
+        return false;
+    
+    c->sock = netOpen(INADDR_ANY, 0);
+    c->id = -1;
+    c->input_seq = 0;
+    c->has_latest = false;
+    c->bytes_received = 0;
+    
+    int k;
+    for ( k=0 ; k<NET_HISTORY ; k++ )
+        c->history[k].valid = false;
+    
+    return c->sock != INVALID_SOCKET;
+}
+
+void clientHello(NetClient *c)
+{
+    unsigned char hello = NET_HELLO;
+    sendto(c->sock, (char *)&hello, 1, 0, (struct sockaddr *)&c->server, sizeof(c->server));
+}
+
+void clientSendInput(NetClient *c, int buttons, float rot)
+{
+    unsigned char buf[9];
+    unsigned char *q = buf;
+    
+    *q++ = NET_INPUT;
+    netPut16(&q, ++c->input_seq);
+    netPut16(&q, c->latest);
+    *q++ = c->has_latest;
+    *q++ = buttons;
+    netPut16(&q, (int)(rot * 100));
+    
+    sendto(c->sock, (char *)buf, sizeof(buf), 0, (struct sockaddr *)&c->server, sizeof(c->server));
+}
+
+void clientReceive(NetClient *c, bool apply)
+{
+    int n;
+    while ( (n = recvfrom(c->sock, (char *)net_buf, sizeof(net_buf), 0, NULL, NULL)) > 0 )
+    {
+        c->bytes_received += n;
+        
+        if ( net_buf[0] == NET_WELCOME && n >= 6 && c->id < 0 ) {
+            const unsigned char *q = net_buf+2;
+            c->id = net_buf[1];
+            if ( apply ) {
+                building_seed = netGet32(&q);
+                generateLevel();
+            }
+        } else if ( net_buf[0] == NET_SNAPSHOT ) {
+            decodeSnapshot(c, net_buf, n, apply);
+        }
+    }
+}
+
+void runClient(const char *host, int port)
+{
+    NetClient *c = &net_client;
+    if ( !clientOpen(c, host, port) ) {
+        fprintf(stderr, "Could not open a socket to %s:%i\n", host, port);
+        exit(EXIT_FAILURE);
+    }
+    
+    double start = nowSeconds();
+    while ( c->id < 0 && nowSeconds() - start < NET_TIMEOUT ) {
+        clientHello(c);
+        netWait(c->sock, 0.25);
+        clientReceive(c, true);
+    }
+    if ( c->id < 0 ) {
+        fprintf(stderr, "No answer from %s:%i\n", host, port);
+        exit(EXIT_FAILURE);
+    }
+    printf("Joined %s:%i as player %i\n", host, port, c->id);
+    
+    openWindow();
+    pos_y = 8.0f;
+    render_setup();
+    
+    tv0 = glfwGetTime();
+    double next_input = tv0;
+    
+    while ( !glfwWindowShouldClose(window) )
+    {
+        if ( isIdle() ) {       // the server keeps running, so keep in touch but stop drawing
+            glfwWaitEventsTimeout(IDLE_WAIT);
+            idleInput();
+            clientSendInput(c, 0, rot_y);
+            clientReceive(c, true);
+            tv0 = glfwGetTime();
+            next_input = tv0;
+            continue;
+        }
+        
+        glfwPollEvents();
+        get_common_input();
+        
+        double now = glfwGetTime();
+        if ( now >= next_input ) {
+            clientSendInput(c, readButtons(), rot_y);
+            next_input += NET_INPUT_INTERVAL;
+            if ( next_input < now )
+                next_input = now + NET_INPUT_INTERVAL;
+        }
+        
+        clientReceive(c, true);
+        
+        getFPS();
+        updateQuality(Tdel);
+        render();
+    }
+    
+    closesocket(c->sock);
+    cleanup();
+}
+
+void benchNetwork(int numClients)
+{
+    int counts[] = { 0, 256, 1024, 2048, 4096 };
+    int ticksPerRun = 300;
+    
+    if ( numClients < 1 || numClients > MAX_PLAYERS )
+        numClients = MAX_PLAYERS;
+    
+    server_mode = true;
+    
+    SOCKET sock = netOpen(INADDR_LOOPBACK, 0);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    if ( sock == INVALID_SOCKET || getsockname(sock, (struct sockaddr *)&addr, &addrlen) != 0 ) {
+        fprintf(stderr, "Could not open a loopback socket\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    NetClient *clients = malloc(numClients * sizeof(NetClient));
+    if ( !clients )
+        exit(EXIT_FAILURE);
+    
+    serverSetup();
+    
+    int k;
+    for ( k=0 ; k<numClients ; k++ ) {
+        clientOpen(&clients[k], "127.0.0.1", ntohs(addr.sin_port));
+        clientHello(&clients[k]);
+    }
+    netWait(sock, 0.1);
+    serverReceive(sock);
+    for ( k=0 ; k<numClients ; k++ ) {
+        netWait(clients[k].sock, 0.1);
+        clientReceive(&clients[k], false);
+    }
+    
+    printf("%i clients on loopback, %i ticks per run, snapshots at %i Hz\n",
+           numClients, ticksPerRun, TARGET_FPS/NET_SNAPSHOT_INTERVAL);
+    printf("enemies   in view   sim ms/tick   send ms/snapshot   bytes/snapshot   kB/s/client   failed sends\n");
+    
+    int r;
+    for ( r=0 ; r<(int)(sizeof(counts)/sizeof(counts[0])) ; r++ )
+    {
+        int p, i, t;
+        for ( i=0 ; i<MAX_ENEMIES ; i++ )
+            enemies[i].alive = false;
+        for ( p=0 ; p<MAX_PLAYERS ; p++ ) {
+            players[p].bytes_sent = 0;
+            players[p].snapshots_sent = 0;
+            players[p].sends_failed = 0;
+        }
+        
+        double sim = 0.0, send = 0.0;
+        long visible = 0;
+        int sends = 0;
+        
+        for ( t=0 ; t<ticksPerRun ; t++ )
+        {
+            if ( t%2 == 0 )
+                for ( k=0 ; k<numClients ; k++ )
+                    clientSendInput(&clients[k], INPUT_SHOOT, (t*3 + k*45) % 360 - 180);
+            serverReceive(sock);
+            
+            int alive = 0;          // keep the requested number of enemies around the players
+            for ( i=0 ; i<MAX_ENEMIES ; i++ )
+                alive += enemies[i].alive;
+            for ( i=0 ; i<MAX_ENEMIES && alive < counts[r] ; i++ ) {
+                if ( !enemies[i].alive ) {
+                    Player *pl = &players[i % numClients];
+                    enemies[i].x = pl->x + gameRand()%61 - 30;
+                    enemies[i].y = pl->z + gameRand()%61 - 30;
+                    enemies[i].direction = gameRand()%4;
+                    enemies[i].alive = !grid[(int)enemies[i].x+100][(int)enemies[i].y+100] &&
+                                       fabs(enemies[i].x) < 98 && fabs(enemies[i].y) < 98;
+                    alive += enemies[i].alive;
+                }
+            }
+            
+            Tdel = TIMEDEL60;
+            double t0 = nowSeconds();
+            serverTick();
+            double t1 = nowSeconds();
+            sim += t1 - t0;
+            
+            if ( ticks%NET_SNAPSHOT_INTERVAL == 0 ) {
+                buildView(&net_view, players[0].x, players[0].z);
+                visible += net_view.count;
+                sendSnapshots(sock);
+                send += nowSeconds() - t1;
+                sends++;
+            }
+            
+            for ( k=0 ; k<numClients ; k++ )
+                clientReceive(&clients[k], false);
+        }
+        
+        size_t bytes = 0;
+        int snapshots = 0, failed = 0;
+        for ( p=0 ; p<MAX_PLAYERS ; p++ ) {
+            bytes += players[p].bytes_sent;
+            snapshots += players[p].snapshots_sent;
+            failed += players[p].sends_failed;
+        }
+        
+        printf("%7i   %7li   %11.3f   %16.3f   %14.0f   %11.1f   %12i\n", counts[r], sends ? visible/sends : 0,
+               sim*1000/ticksPerRun, sends ? send*1000/sends : 0.0,
+               snapshots ? bytes/(double)snapshots : 0.0,
+               snapshots ? bytes/(double)(snapshots + failed) * TARGET_FPS/NET_SNAPSHOT_INTERVAL / 1024 : 0.0, failed);
+    }
+    
+    for ( k=0 ; k<numClients ; k++ )
+        closesocket(clients[k].sock);
+    free(clients);
+    closesocket(sock);
+}
+
+#ifndef _WIN32
+void *eventWriterThread(void *arg)
+{
+    eventWriterLoop();
+    return NULL;
+}
+#else
+DWORD WINAPI eventWriterThread(LPVOID arg)
+{
+    eventWriterLoop();
+    return 0;
+}
+#endif
+
+bool openEventLog(const char *path)
+{
+    event_log = fopen(path, "wb");
+    if ( !event_log )
+        return false;
+    
+    EventLogHeader h;
+    h.magic = EVENT_LOG_MAGIC;
+    h.version = EVENT_LOG_VERSION;
+    h.record_size = sizeof(Event);
+    fwrite(&h, sizeof(h), 1, event_log);
+    
+    event_ring.head = event_ring.tail = 0;
+    event_log_stop = 0;
+    events_dropped = 0;
+    
+#ifndef _WIN32
+    bool started = pthread_create(&event_thread, NULL, eventWriterThread, NULL) == 0;
+#else
+    event_thread = CreateThread(NULL, 0, eventWriterThread, NULL, 0, NULL);
+    bool started = event_thread != NULL;
+#endif
+    
+    if ( !started ) {
+        fclose(event_log);
+        event_log = NULL;
+    }
+    
+    return started;
+}
+
+void closeEventLog()
+{
+    if ( !event_log )
+        return;
+    
+    STORE_RELEASE(&event_log_stop, 1);
+#ifndef _WIN32
+    pthread_join(event_thread, NULL);
+#else
+    WaitForSingleObject(event_thread, INFINITE);
+    CloseHandle(event_thread);
+#endif
+    
+    if ( events_dropped > 0 ) {         // the writer is gone, so this one goes straight to the file
+        Event e;
+        memset(&e, 0, sizeof(e));
+        e.tick = ticks;
+        e.type = EVENT_DROPPED;
+        e.value = events_dropped;
+        fwrite(&e, sizeof(e), 1, event_log);
+    }
+    
+    fclose(event_log);
+    event_log = NULL;
+}
+
+void logEvent(int type, int player, int cause, float x, float y, int value, int total)    // never blocks, drops when the ring is full
+{
+    if ( !event_log )
+        return;
+    
+    unsigned int head = event_ring.head;
+    if ( head - LOAD_ACQUIRE(&event_ring.tail) >= EVENT_RING_SIZE ) {
+        events_dropped++;
+        return;
+    }
+    
+    Event *e = &event_ring.events[head & (EVENT_RING_SIZE-1)];
+    e->tick = ticks;
+    e->type = type;
+    e->player = player;
+    e->cause = cause;
+    e->x = x;
+    e->y = y;
+    e->value = value;
+    e->total = total;
+    
+    STORE_RELEASE(&event_ring.head, head+1);
+}
+
+void eventWriterLoop()
+{
+    while ( true )
+    {
+        unsigned int stopping = LOAD_ACQUIRE(&event_log_stop);      // read before head, so nothing pushed before the stop is missed
+        unsigned int head = LOAD_ACQUIRE(&event_ring.head);
+        unsigned int tail = event_ring.tail;
+        
+        while ( tail != head ) {
+            unsigned int start = tail & (EVENT_RING_SIZE-1);
+            unsigned int n = min(head - tail, EVENT_RING_SIZE - start);
+            
+            fwrite(&event_ring.events[start], sizeof(Event), n, event_log);
+            tail += n;
+            STORE_RELEASE(&event_ring.tail, tail);
+        }
+        
+        if ( stopping )
+            break;
+        
+        fflush(event_log);
+#ifndef _WIN32
+        struct timespec ts = { 0, EVENT_WRITER_SLEEP * 1000000L };
+        nanosleep(&ts, NULL);
+#else
+        Sleep(EVENT_WRITER_SLEEP);
+#endif
+    }
+}
+
+int summarizeEvents(const char *path)
+{
+    char *typeNames[NUM_EVENT_TYPES] = { "?", "kills", "deaths", "objectives", "levels", "score changes", "dropped" };
+    char *causeNames[NUM_CAUSES] = { "-", "fell off the edge", "out of time", "own bullet", "hugged a square", "objective", "restart" };
+    
+    FILE *f = fopen(path, "rb");
+    if ( !f ) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return EXIT_FAILURE;
+    }
+    
+    EventLogHeader h;
+    if ( fread(&h, sizeof(h), 1, f) != 1 || h.magic != EVENT_LOG_MAGIC ||
+         h.version != EVENT_LOG_VERSION || h.record_size != sizeof(Event) ) {
+        fprintf(stderr, "%s is not an event log\n", path);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    
+    long types[NUM_EVENT_TYPES] = { 0 };
+    long deaths[NUM_CAUSES] = { 0 };
+    long levels[NUM_CAUSES] = { 0 };
+    long kills[MAX_PLAYERS] = { 0 };
+    long points[MAX_PLAYERS] = { 0 };
+    int best[MAX_PLAYERS] = { 0 };
+    long dropped = 0, records = 0;
+    int first = 0, last = 0;
+    
+    Event e;
+    while ( fread(&e, sizeof(e), 1, f) == 1 )
+    {
+        if ( records++ == 0 )
+            first = e.tick;
+        last = e.tick;
+        
+        int type = e.type < NUM_EVENT_TYPES ? e.type : 0;
+        int cause = e.cause < NUM_CAUSES ? e.cause : 0;
+        int p = e.player < MAX_PLAYERS ? e.player : 0;
+        types[type]++;
+        
+        switch ( type ) {
+            case EVENT_KILL:
+                kills[p]++;
+                break;
+            case EVENT_DEATH:
+                deaths[cause]++;
+                break;
+            case EVENT_LEVEL:
+                levels[cause]++;
+                break;
+            case EVENT_SCORE:
+                points[p] += e.value;
+                best[p] = max(best[p], e.total);
+                break;
+            case EVENT_DROPPED:
+                dropped += e.value;
+                break;
+        }
+    }
+    fclose(f);
+    
+    printf("%s: %li events over ticks %i-%i (%.1f s)\n", path, records, first, last, (last-first) * TIMEDEL60);
+    
+    int i;
+    for ( i=1 ; i<NUM_EVENT_TYPES ; i++ )
+        printf("  %-14s %li\n", typeNames[i], types[i]);
+    if ( dropped )
+        printf("  %li events were dropped because the writer fell behind\n", dropped);
+    
+    printf("Deaths by cause:\n");
+    for ( i=1 ; i<NUM_CAUSES ; i++ )
+        if ( deaths[i] )
+            printf("  %-18s %li\n", causeNames[i], deaths[i]);
+    printf("New levels by cause:\n");
+    for ( i=1 ; i<NUM_CAUSES ; i++ )
+        if ( levels[i] )
+            printf("  %-18s %li\n", causeNames[i], levels[i]);
+    
+    printf("Player   kills   points   best score\n");
+    for ( i=0 ; i<MAX_PLAYERS ; i++ )
+        if ( kills[i] || points[i] )
+            printf("%6i   %5li   %6li   %10i\n", i, kills[i], points[i], best[i]);
+    
+    return EXIT_SUCCESS;
+}
+
+bool openOffscreenContext()     // surfaceless EGL on Mesa, a hidden window everywhere else
+{
+#ifndef _WIN32
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    
+    if ( getPlatformDisplay )
+        egl_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if ( egl_display == EGL_NO_DISPLAY )
+        egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if ( egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API) ) {
+        egl_display = EGL_NO_DISPLAY;
+        return false;
+    }
+    
+    EGLint attribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint numConfigs;
+    
+    if ( !eglChooseConfig(egl_display, attribs, &config, 1, &numConfigs) || numConfigs < 1 ) {
+        closeOffscreenContext();
+        return false;
+    }
+    
+    egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, NULL);
+    if ( egl_context == EGL_NO_CONTEXT || !eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context) ) {
+        closeOffscreenContext();
+        return false;
+    }
+    
+    return true;
+#else
+    glfwSetErrorCallback(error_callback);
+    if ( !glfwInit() )
+        return false;
+    
+    glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+    window = glfwCreateWindow(width, height, "LD28 - offscreen", NULL, NULL);
+    if ( !window )
+        return false;
+    
+    glfwMakeContextCurrent(window);
+    return true;
+#endif
+}
+
+void closeOffscreenContext()
+{
+#ifndef _WIN32
+    if ( egl_display == EGL_NO_DISPLAY )
+        return;
+    
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if ( egl_context != EGL_NO_CONTEXT )
+        eglDestroyContext(egl_display, egl_context);
+    eglTerminate(egl_display);
+    
+    egl_context = EGL_NO_CONTEXT;
+    egl_display = EGL_NO_DISPLAY;
+#endif
+}
+
+int scriptInput(int frame)      // a fixed session, so the same seed always renders the same frames
+{
+    rot_y = 180.0f * sinf(frame / 120.0f);
+    
+    int buttons = INPUT_SHOOT;
+    switch ( (frame/90) % 4 ) {
+        case 0:
+            buttons |= INPUT_UP;
+            break;
+        case 1:
+            buttons |= INPUT_RIGHT;
+            break;
+        case 2:
+            buttons |= INPUT_DOWN;
+            break;
+        default:
+            buttons |= INPUT_LEFT;
+            break;
+    }
+    if ( frame%240 < 60 )
+        buttons |= INPUT_FORWARD;
+    
+    return buttons;
+}
+
+bool writePPM(const char *path, int w, int h, const unsigned char *pixels)
+{
+    FILE *f = fopen(path, "wb");
+    if ( !f )
+        return false;
+    
+    fprintf(f, "P6\n%i %i\n255\n", w, h);
+    
+    bool ok = true;
+    int y;
+    for ( y=h-1 ; y>=0 && ok ; y-- )        // GL rows start at the bottom
+        ok = fwrite(pixels + y*w*3, 3, w, f) == (size_t)w;
+    
+    return (fclose(f) == 0) && ok;
+}
+
+unsigned char *readPPM(const char *path, int *w, int *h)     // returns rows bottom-up, like glReadPixels
+{
+    FILE *f = fopen(path, "rb");
+    if ( !f )
+        return NULL;
+    
+    int maxval;
+    if ( fscanf(f, "P6 %i %i %i", w, h, &maxval) != 3 || maxval != 255 || *w <= 0 || *h <= 0 || fgetc(f) == EOF ) {
+        fclose(f);
+        return NULL;
+    }
+    
+    unsigned char *pixels = malloc((size_t)*w * *h * 3);
+    bool ok = pixels != NULL;
+    
+    int y;
+    for ( y=*h-1 ; y>=0 && ok ; y-- )
+        ok = fread(pixels + (size_t)y * *w * 3, 3, *w, f) == (size_t)*w;
+    fclose(f);
+    
+    if ( !ok ) {
+        free(pixels);
+        return NULL;
+    }
+    
+    return pixels;
+}
+
+bool compareGolden(const char *path, int w, int h, const unsigned char *pixels)
+{
+    int gw, gh;
+    unsigned char *golden = readPPM(path, &gw, &gh);
+    
+    if ( !golden ) {
+        printf("%s: missing or unreadable\n", path);
+        return false;
+    }
+    if ( gw != w || gh != h ) {
+        printf("%s: golden is %ix%i, frame is %ix%i\n", path, gw, gh, w, h);
+        free(golden);
+        return false;
+    }
+    
+    int i, c, worst = 0;
+    long mismatched = 0;
+    for ( i=0 ; i<w*h ; i++ ) {
+        int diff = 0;
+        for ( c=0 ; c<3 ; c++ )
+            diff = max(diff, abs(pixels[i*3+c] - golden[i*3+c]));
+        worst = max(worst, diff);
+        mismatched += diff > GOLDEN_TOLERANCE;
+    }
+    free(golden);
+    
+    bool ok = mismatched <= GOLDEN_MAX_MISMATCH * w * h;
+    printf("%s: %s, %li pixels over tolerance, max difference %i\n", path, ok ? "match" : "MISMATCH", mismatched, worst);
+    
+    return ok;
+}
+
+int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    
+    return (x > y) - (x < y);
+}
+
+int runOffscreen(int frames, int every, const char *dump_dir, const char *golden_dir)
+{
+    offscreen = true;
+    
+    if ( frames < 1 || width < 1 || height < 1 ) {
+        fprintf(stderr, "Nothing to render\n");
+        return EXIT_FAILURE;
+    }
+    if ( !openOffscreenContext() ) {
+        fprintf(stderr, "Could not create an offscreen GL context\n");
+        return EXIT_FAILURE;
+    }
+    
+    render_setup();
+    if ( !fbo_supported ) {
+        fprintf(stderr, "Offscreen rendering needs GL_ARB_framebuffer_object\n");
+        closeOffscreenContext();
+        return EXIT_FAILURE;
+    }
+    
+    QualityLevel *q = &quality_levels[quality_level];
+    printf("Rendering %i frames of level %i at %ix%i, quality level %i (%ix MSAA, %.0f%% resolution) on %s\n",
+           frames, building_seed, width, height, quality_level, min(q->samples, max_samples), q->scale*100,
+           (const char *)glGetString(GL_RENDERER));
+    
+    pos_y = 8.0f;
+    setup();
+    
+    double *times = malloc(frames * sizeof(double));
+    unsigned char *pixels = malloc((size_t)width * height * 3);
+    if ( !times || !pixels ) {
+        closeOffscreenContext();
+        return EXIT_FAILURE;
+    }
+    
+    bool ok = true;
+    int f;
+    for ( f=0 ; f<frames ; f++ )
+    {
+        int buttons = scriptInput(f);
+        
+        Tdel = TIMEDEL60;
+        movePlayer(&pos_x, &pos_z, rot_y, buttons);
+        firePlayer(pos_x, pos_z, rot_y, buttons, 0);
+        timer += TIMEDEL60;
+        simulate();
+        
+        double t0 = nowSeconds();
+        render();
+        glFinish();
+        times[f] = nowSeconds() - t0;
+        
+        if ( !fbo_bound ) {         // a surfaceless context has no default framebuffer to fall back to
+            fprintf(stderr, "Lost the offscreen framebuffer at frame %i\n", f);
+            free(times);
+            free(pixels);
+            closeOffscreenContext();
+            return EXIT_FAILURE;
+        }
+        
+        if ( (!dump_dir && !golden_dir) || (f%every != every-1 && f != frames-1) )
+            continue;
+        
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, fbo_width, fbo_height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        
+        char path[1024];
+        if ( dump_dir ) {
+            snprintf(path, sizeof(path), "%s/frame_%05i.ppm", dump_dir, f);
+            if ( !writePPM(path, fbo_width, fbo_height, pixels) ) {
+                fprintf(stderr, "Could not write %s\n", path);
+                ok = false;
+            }
+        }
+        if ( golden_dir ) {
+            snprintf(path, sizeof(path), "%s/frame_%05i.ppm", golden_dir, f);
+            ok = compareGolden(path, fbo_width, fbo_height, pixels) && ok;
+        }
+    }
+    
+    double total = 0.0;
+    for ( f=0 ; f<frames ; f++ )
+        total += times[f];
+    qsort(times, frames, sizeof(double), compareDoubles);
+    
+    printf("Frame time: avg %.3f ms, min %.3f ms, median %.3f ms, p95 %.3f ms, max %.3f ms\n",
+           total*1000/frames, times[0]*1000, times[frames/2]*1000, times[frames*95/100]*1000, times[frames-1]*1000);
+    
+    free(times);
+    free(pixels);
+    closeOffscreenContext();
+    
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void cleanup()
+{
+    closeEventLog();
+    closeLevelCache();
+    glfwTerminate();
+}
+
+void scroll_callback(GLFWwindow *window, double xoffset, double yoffset)
+{
+    if ( yoffset < 0 && pos_y < 128 )
+        pos_y /= -yoffset/1.1f;
+    else if ( yoffset > 0 && pos_y > 4 )
+        pos_y *= yoffset/1.1f;
+}
+
+void focus_callback(GLFWwindow *window, int focused)
+{
+    window_focused = focused;
+}
+
+void iconify_callback(GLFWwindow *window, int iconified)
+{
+    window_iconified = iconified;
 }
 
 void error_callback(int error, const char *description)